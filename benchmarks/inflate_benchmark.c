@@ -0,0 +1,162 @@
+// Compares the server's IDAT inflater with stb_image's zlib decoder on the
+// image data of the given PNG files.
+//
+//     gcc -O3 -o inflate_benchmark benchmarks/inflate_benchmark.c -luuid -lm -pthread
+//     gcc -O3 -DINFLATE_FAST_LOOP=0 -o inflate_benchmark_slow benchmarks/inflate_benchmark.c -luuid -lm -pthread
+//     ./inflate_benchmark srv/front/*.png
+
+#define main server_main
+#include "../server.c"
+#undef main
+
+#define BENCHMARK_BYTES (256 * 1024 * 1024)
+#define BENCHMARK_MAX_REPEATS 200
+
+double benchmark_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+unsigned char *read_image_data(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    rewind(file);
+    unsigned char *png = malloc(file_size > 0 ? file_size : 1);
+    unsigned char *data = malloc(file_size > 0 ? file_size : 1);
+    if (!png || !data || fread(png, 1, file_size, file) != (size_t)file_size) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        fclose(file);
+        free(png);
+        free(data);
+        return NULL;
+    }
+    fclose(file);
+
+    // The zlib stream is the concatenation of every IDAT chunk.
+    *size = 0;
+    for (long position = 8; position + 12 <= file_size; ) {
+        uint32_t length = (uint32_t)png[position] << 24 | (uint32_t)png[position + 1] << 16 |
+                          (uint32_t)png[position + 2] << 8 | png[position + 3];
+        if (length > (uint32_t)(file_size - position - 12)) {
+            break;
+        }
+        if (memcmp(png + position + 4, "IDAT", 4) == 0) {
+            memcpy(data + *size, png + position + 8, length);
+            *size += length;
+        }
+        position += 12 + (long)length;
+    }
+    free(png);
+
+    return data;
+}
+
+size_t inflate_all(inflater *z, unsigned char *window, const unsigned char *data, size_t size)
+{
+    inflate_init(z, window, INFLATE_OUTPUT_SIZE);
+
+    size_t total = 0;
+    uint32_t adler = 1;
+    while (true) {
+        inflate_result result = inflate_run(z, data, size, true);
+        adler = adler32_update(adler, z->output + z->output_start, z->output_position - z->output_start);
+        total += z->output_position - z->output_start;
+        if (result == INFLATE_FINISHED) {
+            break;
+        }
+        if (result != INFLATE_OK) {
+            return 0;
+        }
+    }
+
+    return adler == z->expected_adler ? total : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s image.png...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    inflater *z = malloc(sizeof(*z));
+    unsigned char *window = malloc(INFLATE_OUTPUT_SIZE);
+    if (!z || !window) {
+        fprintf(stderr, "Failed to allocate the inflater\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Inflate fast loop: %s\n", INFLATE_FAST_LOOP ? "on" : "off");
+    printf("%-32s %12s %12s %12s\n", "image", "bytes", "stb MB/s", "server MB/s");
+
+    double stb_seconds = 0, server_seconds = 0;
+    size_t total_bytes = 0;
+    int program_status = EXIT_SUCCESS;
+    for (int i = 1; i < argc; i++) {
+        size_t size;
+        unsigned char *data = read_image_data(argv[i], &size);
+        if (!data) {
+            program_status = EXIT_FAILURE;
+            continue;
+        }
+
+        // stb_image allocates through the server's slab allocator.
+        int expected = 0;
+        char *reference = stbi_zlib_decode_malloc((const char *)data, (int)size, &expected);
+        if (!reference) {
+            fprintf(stderr, "%s: stb_image could not inflate the image data\n", argv[i]);
+            free(data);
+            program_status = EXIT_FAILURE;
+            continue;
+        }
+        slab_free(reference);
+        if (inflate_all(z, window, data, size) != (size_t)expected) {
+            fprintf(stderr, "%s: the server inflater disagrees with stb_image\n", argv[i]);
+            free(data);
+            program_status = EXIT_FAILURE;
+            continue;
+        }
+
+        int repeats = BENCHMARK_BYTES / (expected + 1) + 1;
+        repeats = repeats < BENCHMARK_MAX_REPEATS ? repeats : BENCHMARK_MAX_REPEATS;
+
+        double start = benchmark_seconds();
+        for (int r = 0; r < repeats; r++) {
+            int length;
+            slab_free(stbi_zlib_decode_malloc((const char *)data, (int)size, &length));
+        }
+        double middle = benchmark_seconds();
+        for (int r = 0; r < repeats; r++) {
+            inflate_all(z, window, data, size);
+        }
+        double end = benchmark_seconds();
+
+        double stb = (middle - start) / repeats;
+        double server = (end - middle) / repeats;
+        printf("%-32s %12d %12.0f %12.0f\n", argv[i], expected, expected / stb / 1e6, expected / server / 1e6);
+
+        stb_seconds += stb;
+        server_seconds += server;
+        total_bytes += expected;
+        free(data);
+    }
+
+    if (total_bytes > 0) {
+        printf("%-32s %12zu %12.0f %12.0f\n", "total", total_bytes, total_bytes / stb_seconds / 1e6, total_bytes / server_seconds / 1e6);
+    }
+
+    free(window);
+    free(z);
+
+    return program_status;
+}
@@ -1,20 +1,61 @@
+#define _GNU_SOURCE
+
 #include <fcntl.h>
 #include <limits.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
+#include <dirent.h>
 #include <errno.h>
 #include <math.h>
 
+#ifndef INFLATE_FAST_LOOP
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define INFLATE_FAST_LOOP 1
+#else
+#define INFLATE_FAST_LOOP 0
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEDIAN_X86_SIMD 1
+#define PNG_X86_SIMD 1
+#endif
+
+void *slab_alloc(size_t size);
+void *slab_realloc(void *data, size_t size);
+void slab_free(void *data);
+
+#define STBI_MALLOC(size) slab_alloc(size)
+#define STBI_REALLOC(data, size) slab_realloc(data, size)
+#define STBI_FREE(data) slab_free(data)
+#define STBIW_MALLOC(size) slab_alloc(size)
+#define STBIW_REALLOC(data, size) slab_realloc(data, size)
+#define STBIW_FREE(data) slab_free(data)
+
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 #define STB_IMAGE_IMPLEMENTATION
@@ -29,708 +70,7132 @@
 #define SERVER_DIR "srv/front"
 
 #define MAX_QUEUED_CONNECTIONS SOMAXCONN
-#define MAX_REQUEST_SIZE 2048
+#define MAX_REQUEST_SIZE 8192
+#define MAX_REQUEST_HEADERS 64
+#define MAX_RESPONSE_HEADER_SIZE 512
 #define MAX_IMAGE_SIZE (10 * 1024 * 1024)
+#define MAX_IMAGE_DIMENSION (1 << 24)
 #define MEDIAN_WINDOW 3
+#define MAX_MEDIAN_WINDOW 31
+#define MEDIAN_NETWORK_MAX_WINDOW 3
+#define DEFAULT_WORKER_THREADS 16
+#define MAX_WORKER_THREADS 1024
+#define MAX_FILTER_THREADS 256
+#define MAX_BAND_THREADS 256
+#define PARALLEL_FILTER_MIN_PIXELS (512 * 512)
+#define BAND_TASKS_PER_THREAD 4
+#define MIN_BAND_ROWS 16
+#define CONNECTION_QUEUE_SIZE 1024
+#define IMAGE_TASK_QUEUE_SIZE 64
+#define DEFAULT_MEMORY_LIMIT_MB 1024
+#define MAX_MEMORY_LIMIT_MB (1024 * 1024)
+#define RETRY_AFTER_SECONDS 2
+#define CLIENT_TIMEOUT_SECONDS 15
+#define DRAIN_TIMEOUT_SECONDS 2
+#define KEEP_ALIVE_TIMEOUT_SECONDS 5
+#define MAX_KEEP_ALIVE_REQUESTS 1000
+#define MAX_EPOLL_EVENTS 256
+#define JOB_STORE_SHARD_BITS 6
+#define JOB_STORE_SHARDS (1 << JOB_STORE_SHARD_BITS)
+#define JOB_STORE_INITIAL_CAPACITY 64
+#define RESULT_CACHE_INITIAL_CAPACITY 64
+#define DEFAULT_RESULT_LIMIT_MB 1024
+#define DEFAULT_RESULT_TTL_SECONDS (60 * 60)
+#define MAX_RESULT_TTL_SECONDS (7 * 24 * 60 * 60)
+#define TOMBSTONE_SECONDS (24 * 60 * 60)
+#define RETENTION_SWEEP_SECONDS 1
+#define SLAB_MIN_BITS 16
+#define SLAB_MAX_BITS 26
+#define SLAB_CLASSES (4 * (SLAB_MAX_BITS - SLAB_MIN_BITS))
+#define SLAB_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define SLAB_THREAD_CACHE_MAX_BYTES (4 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGETLB_RETRY_SECONDS 10
+#define MAX_STATS_SIZE 1024
+#define CACHE_LINE_SIZE 64
+#define STATIC_CACHE_INITIAL_CAPACITY 64
+#define STATIC_CACHE_MAX_FILE_SIZE (4 * 1024 * 1024)
+#define STATIC_CACHE_MAX_SIZE (64 * 1024 * 1024)
+#define INFLATE_FAST_BITS 10
+#define INFLATE_MAX_SYMBOLS 288
+#define INFLATE_MAX_SYMBOL_BITS 48
+#define INFLATE_MAX_MATCH 258
+#define INFLATE_WINDOW_SIZE 32768
+#define INFLATE_OUTPUT_SIZE (4 * INFLATE_WINDOW_SIZE)
+#define INGEST_CHECK_SIZE (16 * 1024)
+#define INFLATE_FAST_INPUT_MARGIN 16
+#define INFLATE_FAST_OUTPUT_MARGIN (INFLATE_MAX_MATCH + 16)
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MIN_LOOKAHEAD (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+#define DEFLATE_MAX_DISTANCE (DEFLATE_WINDOW_SIZE - DEFLATE_MIN_LOOKAHEAD)
+#define DEFLATE_FAR_MATCH_DISTANCE 4096
+#define DEFLATE_BLOCK_SYMBOLS 16384
+#define DEFLATE_MAX_STORED_BLOCK 65535
+#define DEFLATE_OUTPUT_SIZE (2 * DEFLATE_WINDOW_SIZE + 64)
+#define PNG_HEADER_SIZE 33
+#define PNG_IDAT_SIZE 65536
+#define PNG_SEGMENT_SIZE (128 * 1024)
+
+typedef enum
+{
+    SLAB_PAGES_NORMAL,
+    SLAB_PAGES_TRANSPARENT,
+    SLAB_PAGES_HUGETLB
+} slab_pages;
+
+typedef struct slab_block
+{
+    _Alignas(16) union
+    {
+        struct slab_block *next;
+        size_t size;
+    };
+    int size_class;
+    bool mapped;
+    unsigned char pages;
+} slab_block;
+
+typedef struct
+{
+    slab_block *free_blocks[SLAB_CLASSES];
+    size_t cached_bytes;
+    bool registered;
+} slab_cache;
 
 typedef struct
 {
-    unsigned char **buffer;
-    size_t *size;
+    pthread_mutex_t lock;
+    slab_block *free_blocks[SLAB_CLASSES];
+} slab_depot;
+
+typedef struct
+{
+    atomic_size_t cache_hits;
+    atomic_size_t cache_misses;
+    atomic_size_t cached_bytes;
+    atomic_size_t hugetlb_mappings;
+    atomic_size_t transparent_mappings;
+    atomic_size_t normal_mappings;
+    atomic_size_t hugetlb_allocations;
+    atomic_size_t transparent_allocations;
+    atomic_size_t normal_allocations;
+} slab_statistics;
+
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    bool borrowed;
+    bool failed;
 } buffer_context;
 
 typedef struct
 {
+    uint16_t fast[1 << INFLATE_FAST_BITS];
+    uint16_t first_code[16];
+    uint16_t first_symbol[16];
+    uint32_t max_code[17];
+    uint8_t size[INFLATE_MAX_SYMBOLS];
+    uint16_t value[INFLATE_MAX_SYMBOLS];
+} inflate_huffman;
+
+typedef enum
+{
+    INFLATE_ZLIB_HEADER,
+    INFLATE_BLOCK_HEADER,
+    INFLATE_STORED,
+    INFLATE_HUFFMAN,
+    INFLATE_TRAILER,
+    INFLATE_DONE
+} inflate_state;
+
+typedef enum
+{
+    INFLATE_OK,
+    INFLATE_NEED_INPUT,
+    INFLATE_FINISHED,
+    INFLATE_CORRUPT
+} inflate_result;
+
+typedef struct
+{
+    inflate_state state;
+    bool final_block;
+    size_t stored_remaining;
+    const unsigned char *input;
+    size_t input_size;
+    bool input_final;
+    size_t position;
+    uint64_t bits;
+    int bit_count;
+    size_t overrun;
+    bool starved;
+    unsigned char *output;
+    size_t output_size;
+    size_t output_start;
+    size_t output_position;
+    uint32_t expected_adler;
+    inflate_huffman lengths;
+    inflate_huffman distances;
+#if INFLATE_FAST_LOOP
+    uint32_t literals[1 << INFLATE_FAST_BITS];
+#endif
+} inflater;
+
+typedef bool (*png_row_sink)(void *context, const unsigned char *row);
+
+typedef enum
+{
+    PNG_STREAM_SIGNATURE,
+    PNG_STREAM_CHUNK_HEADER,
+    PNG_STREAM_CHUNK_DATA,
+    PNG_STREAM_CHUNK_CRC,
+    PNG_STREAM_FINISHED,
+    PNG_STREAM_PASSTHROUGH,
+    PNG_STREAM_MALFORMED
+} png_stream_state;
+
+typedef struct
+{
+    png_stream_state state;
+    size_t parsed;
+    uint32_t chunk_length;
+    uint32_t chunk_received;
+    unsigned char chunk_type[4];
+    uint32_t chunk_crc;
+    bool header_seen;
+    int width;
+    int height;
+    int channels;
+    size_t stride;
+    unsigned char *compressed;
+    size_t compressed_size;
+    size_t compressed_capacity;
+    size_t compressed_checked;
+    unsigned char *window;
+    inflater inflater;
+    uint32_t adler;
+    unsigned char *row;
+    size_t row_filled;
+    unsigned char *current;
+    unsigned char *previous;
+    int rows_done;
+    png_row_sink sink;
+    void *sink_context;
+} png_stream;
+
+typedef enum
+{
+    COMPRESSION_FAST,
+    COMPRESSION_BALANCED,
+    COMPRESSION_SMALL,
+    COMPRESSION_PRESETS
+} compression_level;
+
+typedef struct
+{
+    const char *name;
+    int max_chain;
+    size_t lazy_match;
+    size_t nice_match;
+    int filter;
+} compression_preset;
+
+typedef struct
+{
+    const compression_preset *preset;
+    unsigned char *window;
+    size_t window_size;
+    size_t position;
+    size_t block_start;
+    int32_t *head;
+    int32_t *prev;
+    uint16_t *symbol_values;
+    uint16_t *symbol_distances;
+    size_t symbol_count;
+    size_t fixed_bits;
+    size_t match_length;
+    size_t match_distance;
+    bool match_available;
+    uint64_t bits;
+    int bit_count;
+    unsigned char *output;
+    size_t output_size;
+    uint32_t adler;
+    void (*emit)(void *context, const unsigned char *data, size_t size);
+    void *emit_context;
+} deflater;
+
+typedef struct
+{
+    deflater deflater;
+    const unsigned char *dictionary;
+    size_t dictionary_size;
+    const unsigned char *data;
+    size_t size;
+    unsigned char *output;
+    size_t output_size;
+    size_t output_capacity;
+    bool failed;
+} deflate_segment;
+
+typedef struct
+{
+    stbi_write_func *write;
+    void *context;
+    const compression_preset *preset;
+    size_t stride;
+    int channels;
+    unsigned char *previous;
+    unsigned char *candidates;
+    unsigned char *chunk;
+    size_t chunk_size;
+    deflater deflater;
+    uint32_t adler;
+    unsigned char *encoded;
+    size_t encoded_capacity;
+    size_t dictionary_size;
+    deflate_segment *segments;
+    int segment_count;
+    bool segmented;
+} png_writer;
+
+typedef struct image_result
+{
+    atomic_size_t references;
+    unsigned char *data;
+    size_t size;
+} image_result;
+
+typedef enum
+{
+    JOB_LIST_ACCESS,
+    JOB_LIST_AGE,
+    JOB_LIST_KINDS
+} job_list_kind;
+
+typedef struct
+{
+    struct image_job *older;
+    struct image_job *newer;
+} job_link;
+
+typedef struct image_job
+{
+    uuid_t id;
     unsigned char *original_image;
     size_t original_size;
-    unsigned char *processed_image;
-    size_t processed_size;
+    int window;
+    compression_level compression;
+    uint64_t content_hash;
+    bool cached;
+    struct image_job *aliases;
+    struct image_job *next_alias;
+    bool finished;
+    image_result *_Atomic result;
+    atomic_bool expired;
+    _Atomic time_t accessed;
+    time_t listed_at;
+    time_t finished_at;
+    time_t expired_at;
+    size_t charge;
+    job_link links[JOB_LIST_KINDS];
+    struct image_job *next_retired;
+    bool purged;
 } image_job;
 
 typedef struct
 {
-    char *key;
-    image_job value;
-} image_job_entry;
+    image_job *oldest;
+    image_job *newest;
+    job_list_kind kind;
+} job_list;
+
+typedef struct job_slots
+{
+    size_t capacity;
+    struct job_slots *retired;
+    image_job *_Atomic entries[];
+} job_slots;
+
+typedef struct
+{
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    job_slots *_Atomic slots;
+    size_t count;
+} job_shard;
+
+typedef struct
+{
+    job_shard shards[JOB_STORE_SHARDS];
+    _Alignas(CACHE_LINE_SIZE) atomic_uint epoch;
+    atomic_size_t readers[2];
+} job_store;
+
+typedef struct
+{
+    image_job **slots;
+    size_t capacity;
+    size_t count;
+    pthread_mutex_t lock;
+} result_cache;
+
+typedef struct
+{
+    job_list recent;
+    job_list finished;
+    job_list expired;
+    size_t retained;
+    size_t retained_bytes;
+    size_t tombstones;
+    size_t byte_limit;
+    time_t ttl;
+    job_store *jobs;
+    result_cache *results;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t sweeper;
+} job_retention;
+
+typedef enum
+{
+    SERVER_MODE_BLOCKING,
+    SERVER_MODE_EPOLL
+} server_mode;
+
+typedef enum
+{
+    IO_DONE,
+    IO_WANT_READ,
+    IO_WANT_WRITE,
+    IO_CLOSED,
+    IO_ERROR
+} io_status;
+
+typedef enum
+{
+    HTTP_PARSE_INCOMPLETE,
+    HTTP_PARSE_DONE,
+    HTTP_PARSE_INVALID,
+    HTTP_PARSE_TOO_LARGE
+} http_parse_status;
+
+typedef struct
+{
+    size_t offset;
+    size_t length;
+} http_slice;
+
+typedef struct
+{
+    http_slice name;
+    http_slice value;
+} http_header;
+
+typedef struct
+{
+    http_parse_status status;
+    size_t scanned;
+    size_t line_start;
+    http_slice method;
+    http_slice path;
+    http_slice query;
+    int minor_version;
+    http_header headers[MAX_REQUEST_HEADERS];
+    size_t header_count;
+    size_t header_size;
+} http_request;
+
+typedef enum
+{
+    CONNECTION_RECEIVING_HEADERS,
+    CONNECTION_RECEIVING_BODY,
+    CONNECTION_SENDING_RESPONSE,
+    CONNECTION_FINISHED,
+    CONNECTION_DRAINING
+} connection_state;
+
+typedef struct static_file
+{
+    atomic_size_t references;
+    char *path;
+    size_t path_len;
+    char *header;
+    size_t header_size;
+    unsigned char *data;
+    size_t size;
+} static_file;
+
+typedef struct
+{
+    static_file **slots;
+    size_t capacity;
+    size_t count;
+    size_t cached_bytes;
+    pthread_rwlock_t lock;
+    const char *root;
+    int inotify_handle;
+    char **watched_dirs;
+    size_t watched_dirs_capacity;
+    pthread_t watcher;
+    bool watching;
+} static_cache;
+
+typedef struct
+{
+    char header[MAX_RESPONSE_HEADER_SIZE];
+    const char *header_data;
+    size_t header_size;
+    size_t header_sent;
+    const unsigned char *body;
+    size_t body_size;
+    image_result *result;
+    size_t body_sent;
+    char text[MAX_STATS_SIZE];
+    static_file *cached_file;
+    int file_handle;
+    off_t file_offset;
+    size_t file_remaining;
+} http_response;
+
+typedef struct http_connection
+{
+    int socket;
+    connection_state state;
+    char request_data[MAX_REQUEST_SIZE + 1];
+    size_t request_size;
+    size_t request_consumed;
+    http_request request;
+    const char *method;
+    const char *path;
+    const char *query;
+    int window;
+    compression_level compression;
+    unsigned char *body;
+    size_t body_size;
+    size_t content_length;
+    png_stream *ingest;
+    http_response response;
+    bool keep_alive;
+    size_t requests_served;
+    bool idle;
+    time_t last_activity;
+    struct http_connection *prev;
+    struct http_connection *next;
+} http_connection;
+
+typedef struct
+{
+    http_connection *head;
+    http_connection *tail;
+} connection_list;
+
+typedef struct
+{
+    int *sockets;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} connection_queue;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int remaining;
+    int status;
+} band_batch;
+
+typedef struct
+{
+    const unsigned char *const *rows;
+    unsigned char *out;
+    int w;
+    int channels;
+    int radius;
+    int row_count;
+    int (*run)(void *argument);
+    void *argument;
+    band_batch *batch;
+} band_task;
+
+struct band_pool;
+
+typedef struct
+{
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    band_task **tasks;
+    size_t capacity;
+    size_t top;
+    size_t count;
+    struct band_pool *pool;
+    int index;
+} band_deque;
+
+typedef struct band_pool
+{
+    band_deque *deques;
+    pthread_t *threads;
+    int worker_count;
+    int started;
+    atomic_size_t pending;
+    atomic_size_t next_deque;
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    bool stopping;
+} band_pool;
+
+typedef struct
+{
+    int width;
+    int height;
+    int channels;
+    size_t stride;
+    int radius;
+    int batch_rows;
+    int ring_rows;
+    unsigned char *ring;
+    const unsigned char **rows;
+    unsigned char *filtered;
+    int rows_received;
+    int rows_filtered;
+    band_pool *pool;
+    png_writer writer;
+} image_pipeline;
+
+typedef struct image_task
+{
+    image_job *job;
+    size_t memory;
+    size_t upload;
+    struct image_task *next;
+} image_task;
+
+typedef struct
+{
+    image_task *head;
+    image_task *tail;
+    size_t length;
+    size_t memory_limit;
+    size_t memory_reserved;
+    size_t refused;
+    int running;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} image_task_queue;
+
+typedef struct
+{
+    connection_queue queue;
+    image_task_queue tasks;
+    band_pool bands;
+    job_store jobs;
+    result_cache results;
+    job_retention retention;
+    static_cache statics;
+    bool streaming_ingest;
+    char server_dir_path[PATH_MAX + 1];
+    size_t server_dir_path_len;
+} server_context;
+
+typedef struct
+{
+    server_context *context;
+    int server_socket;
+    int epoll_handle;
+    connection_list active_connections;
+    connection_list idle_connections;
+    connection_list draining_connections;
+} event_loop;
 
+int slab_class(size_t size);
+size_t slab_class_size(int size_class);
+void slab_cache_key_init(void);
+void slab_cache_flush(void *argument);
+bool slab_cache_reserve(size_t size);
+slab_block *slab_depot_take(int size_class);
+void slab_depot_put(slab_block *block);
+void slab_pages_init(void);
+void slab_count_allocation(const slab_block *block);
+size_t slab_mapping_size(const slab_block *block);
+slab_block *slab_map(size_t length, slab_pages *pages);
+void slab_release(slab_block *block);
+void buffer_context_init(buffer_context *buffer, unsigned char *slab, size_t slab_size);
+bool buffer_context_reserve(buffer_context *buffer, size_t capacity);
+bool buffer_context_append(buffer_context *buffer, const void *data, size_t size);
+unsigned char *buffer_context_detach(buffer_context *buffer, size_t *size);
+void buffer_context_free(buffer_context *buffer);
+size_t png_output_bound(int w, int h, int channels);
 void write_image_callback(void *context, void *data, int size);
-int float_compare(const void *a, const void *b);
 int setup_server_socket(int *server_socket);
-int receive_request(int request_socket, char *request_data, size_t max_size);
-void parse_request(const char *request_data, char *method, char *path);
+io_status receive_request(http_connection *connection);
+io_status receive_body(http_connection *connection);
+size_t http_scan(const char *data, size_t length, char first, char second);
+bool http_is_token(const char *data, size_t length);
+http_parse_status http_parse_request_line(http_request *request, const char *line, size_t line_start, size_t line_length);
+http_parse_status http_parse_header_line(http_request *request, const char *line, size_t line_start, size_t line_length);
+http_parse_status http_parse_request(http_request *request, char *buffer, size_t size);
+const char *http_request_header(const http_request *request, const char *buffer, const char *name, size_t *value_length);
+const char *connection_header(const http_connection *connection, const char *name, size_t *value_length);
+bool header_contains_token(const char *value, size_t value_len, const char *token);
+int parse_query_parameter(const char *query, const char *name, char *value, size_t value_size);
 void cleanup_connection(int request_socket);
-void cleanup_resources(int file_handle, int request_socket, int server_socket, image_job_entry *job_table);
-void apply_median_filter(unsigned char *img, unsigned char *filtered, int w, int h, int channels);
-void process_image(image_job_entry *job_table, const char *uuid_str);
-ssize_t send_all(int socket, const void *buffer, size_t length, int flags);
+void cleanup_resources(int request_socket, int server_socket, job_store *jobs);
+uint64_t job_id_hash(const uuid_t id);
+job_slots *job_slots_create(size_t capacity);
+void job_slots_place(job_slots *slots, image_job *job);
+void image_result_release(image_result *result);
+void image_job_free(image_job *job);
+int job_store_init(job_store *store);
+void job_store_destroy(job_store *store);
+int job_store_insert(job_store *store, image_job *job);
+image_job *job_store_find(job_store *store, const uuid_t id);
+unsigned job_store_enter(job_store *store);
+void job_store_leave(job_store *store, unsigned epoch);
+void job_store_synchronize(job_store *store);
+void job_store_remove(job_store *store, image_job *jobs);
+job_slots *job_store_detach_retired(job_store *store);
+uint64_t xxh64(const unsigned char *data, size_t size, uint64_t seed);
+void result_cache_place(image_job **slots, size_t capacity, image_job *job);
+int result_cache_init(result_cache *cache);
+void result_cache_destroy(result_cache *cache);
+image_job *result_cache_claim(result_cache *cache, image_job *job, bool *shared);
+image_job **result_cache_locate(result_cache *cache, const image_job *job);
+void result_cache_remove(result_cache *cache, image_job **slot);
+image_job *result_cache_finish(result_cache *cache, image_job *job, image_job **retry);
+void result_cache_forget(result_cache *cache, image_job *job);
+void job_list_push(job_list *list, image_job *job);
+void job_list_remove(job_list *list, image_job *job);
+int job_retention_init(job_retention *retention, job_store *jobs, result_cache *results, size_t byte_limit, time_t ttl);
+void job_retention_destroy(job_retention *retention);
+void job_retention_add(job_retention *retention, image_job *job);
+void job_retention_expire(job_retention *retention, image_job *job, time_t now, image_job **expiring);
+void job_retention_sweep(job_retention *retention, time_t now, image_job **expiring, image_job **purging);
+void job_retention_reclaim(job_retention *retention, image_job *expiring, image_job *purging);
+void *job_retention_worker(void *argument);
+image_job *image_job_finish(server_context *context, image_job *job);
+const char *static_file_content_type(const char *path);
+int format_static_file_header(char *header, size_t header_size, const char *path, const struct stat *file_status);
+uint64_t static_path_hash(const char *path, size_t length);
+static_file *static_file_load(const static_cache *cache, const char *path);
+void static_file_release(static_file *file);
+void static_cache_place(static_file **slots, size_t capacity, static_file *file);
+static_file *static_cache_replace(static_cache *cache, const char *path, static_file *file);
+void static_cache_reload(static_cache *cache, const char *path);
+void static_cache_evict_directory(static_cache *cache, const char *directory, bool unwatch);
+void static_cache_watch(static_cache *cache, const char *directory);
+void static_cache_scan(static_cache *cache, const char *directory);
+static_file *static_cache_find(static_cache *cache, const char *path);
+void *static_cache_worker(void *argument);
+int static_cache_init(static_cache *cache, const char *root);
+void static_cache_destroy(static_cache *cache);
+void median_filter_row_edges(const unsigned char *above, const unsigned char *center, const unsigned char *below, unsigned char *out_row, int w, int channels);
+void median_filter_rows_network(const unsigned char *const *rows, unsigned char *out, int w, int channels, int row_count, unsigned char *scratch);
+#ifdef MEDIAN_X86_SIMD
+void median_filter_rows_sse2(const unsigned char *const *rows, unsigned char *out, int w, int channels, int row_count);
+void median_filter_rows_avx2(const unsigned char *const *rows, unsigned char *out, int w, int channels, int row_count);
+#endif
+void median_histogram_row(const uint16_t (*column_fine)[256], const uint16_t (*column_coarse)[16], unsigned char *out_row, int w, int channels, int channel, int radius);
+int median_filter_rows_histogram(const unsigned char *const *rows, unsigned char *out, int w, int channels, int radius, int row_count);
+int median_filter_rows(const unsigned char *const *rows, unsigned char *out, int w, int channels, int radius, int row_count);
+int band_pool_init(band_pool *pool, int worker_count);
+void band_pool_destroy(band_pool *pool);
+int band_deque_push(band_deque *deque, band_task *task);
+band_task *band_deque_pop(band_deque *deque, bool steal);
+band_task *band_pool_take(band_pool *pool, int own_index);
+void band_task_run(band_task *task);
+int band_pool_run(band_pool *pool, band_task *tasks, int count);
+void *band_worker(void *argument);
+int band_pool_filter(band_pool *pool, const unsigned char *const *rows, unsigned char *out, int w, int h, int channels, int radius);
+void crc32_table_init(void);
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t size);
+uint32_t adler32_update(uint32_t adler, const unsigned char *data, size_t size);
+#ifdef PNG_X86_SIMD
+uint32_t crc32_fold_pclmul(uint32_t crc, const unsigned char *data, size_t size);
+uint32_t adler32_update_ssse3(uint32_t adler, const unsigned char *data, size_t size);
+#endif
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size);
+bool inflate_build_huffman(inflate_huffman *table, const uint8_t *lengths, int count);
+bool inflate_read_dynamic_tables(inflater *z);
+void inflate_build_fixed_tables(inflater *z);
+void inflate_init(inflater *z, unsigned char *output, size_t output_size);
+#if INFLATE_FAST_LOOP
+void inflate_build_literal_table(inflater *z);
+bool inflate_run_fast(inflater *z);
+#endif
+inflate_result inflate_run_header(inflater *z);
+inflate_result inflate_run(inflater *z, const unsigned char *input, size_t input_size, bool input_final);
+#ifdef PNG_X86_SIMD
+void png_unfilter_sub_sse2(const unsigned char *in, unsigned char *out, size_t stride, int bpp);
+void png_unfilter_avg_sse2(const unsigned char *in, const unsigned char *previous, unsigned char *out, size_t stride, int bpp);
+void png_unfilter_paeth_ssse3(const unsigned char *in, const unsigned char *previous, unsigned char *out, size_t stride, int bpp);
+#endif
+bool png_unfilter_row(int filter, const unsigned char *in, const unsigned char *previous, unsigned char *out, size_t stride, int bpp);
+png_stream *png_stream_create(png_row_sink sink, void *sink_context);
+void png_stream_destroy(png_stream *stream);
+void png_stream_release_buffers(png_stream *stream);
+void png_stream_pass_through(png_stream *stream);
+bool png_stream_reject(png_stream *stream);
+bool png_stream_read_header(png_stream *stream, const unsigned char *data, uint32_t length);
+bool png_stream_consume(png_stream *stream, const unsigned char *data, size_t size);
+bool png_stream_inflate(png_stream *stream, bool input_final);
+bool png_stream_append_compressed(png_stream *stream, const unsigned char *data, size_t size);
+bool png_stream_feed(png_stream *stream, const unsigned char *data, size_t size);
+void deflate_tables_init(void);
+int deflate_init(deflater *z, const compression_preset *preset, void (*emit)(void *context, const unsigned char *data, size_t size), void *emit_context);
+void deflate_destroy(deflater *z);
+void deflate_reset(deflater *z);
+void deflate_prime(deflater *z, const unsigned char *dictionary, size_t size);
+size_t deflate_longest_match(deflater *z, int32_t candidate, size_t position, size_t best, size_t *distance);
+void deflate_compress(deflater *z, bool flush);
+void deflate_flush_block(deflater *z, bool final);
+void deflate_slide(deflater *z);
+void deflate_write(deflater *z, const unsigned char *data, size_t size);
+void deflate_flush(deflater *z, bool final);
+void deflate_segment_emit(void *context, const unsigned char *data, size_t size);
+int deflate_segment_run(void *argument);
+int png_filter_row(const unsigned char *row, const unsigned char *previous, unsigned char *candidates, size_t stride, int bpp, int filter);
+void png_writer_chunk(png_writer *writer, const char *type, const unsigned char *data, size_t size);
+void png_writer_emit(void *context, const unsigned char *data, size_t size);
+void png_writer_flush(png_writer *writer);
+int png_writer_init(png_writer *writer, int w, int h, int channels, const compression_preset *preset, stbi_write_func *write, void *context);
+void png_writer_row(png_writer *writer, const unsigned char *row);
+int png_writer_rows(png_writer *writer, const unsigned char *rows, int count, band_pool *pool);
+void png_writer_finish(png_writer *writer);
+void png_writer_destroy(png_writer *writer);
+int image_pipeline_init(image_pipeline *pipeline, int w, int h, int channels, int window, const compression_preset *preset, band_pool *pool, stbi_write_func *write, void *context);
+void image_pipeline_destroy(image_pipeline *pipeline);
+int image_pipeline_filter(image_pipeline *pipeline, int count);
+bool image_pipeline_push(void *context, const unsigned char *row);
+int image_pipeline_finish(image_pipeline *pipeline);
+int process_image_rows(image_job *job, band_pool *pool, buffer_context *output);
+int process_image_frame(image_job *job, band_pool *pool, buffer_context *output);
+size_t job_memory_estimate(int w, int h, int channels);
+void process_image(image_job *job, band_pool *pool);
+int finish_response_header(http_connection *connection);
+io_status send_response(http_connection *connection);
+int queue_response(http_connection *connection, const char *response_data, size_t response_size);
 int set_client_socket_options(int client_socket);
-int handle_post_images(int request_socket, const char *request_data, ssize_t bytes_received, image_job_entry **job_table);
-int handle_get_image(int request_socket, const char *path, image_job_entry *job_table);
-int handle_get_static_file(int request_socket, const char *path, const char *server_dir_path, size_t server_dir_path_len, int *file_to_serve_handle);
-int send_not_implemented(int request_socket);
+int handle_post_images(http_connection *connection, server_context *context);
+int complete_post_images(http_connection *connection, server_context *context);
+int handle_get_image(http_connection *connection, server_context *context);
+int handle_get_stats(http_connection *connection, server_context *context);
+int handle_get_static_file(http_connection *connection, server_context *context);
+int send_not_implemented(http_connection *connection);
+int dispatch_request(http_connection *connection, server_context *context);
+int route_request(http_connection *connection, server_context *context);
+void connection_init(http_connection *connection, int request_socket);
+void connection_reset_request(http_connection *connection);
+void connection_release(http_connection *connection);
+void connection_next_request(http_connection *connection);
+io_status connection_process(http_connection *connection, server_context *context);
+int connection_queue_init(connection_queue *queue, size_t capacity);
+void connection_queue_destroy(connection_queue *queue);
+int connection_queue_push(connection_queue *queue, int request_socket);
+int connection_queue_pop(connection_queue *queue);
+bool connection_queue_waiting(connection_queue *queue);
+void connection_queue_close(connection_queue *queue);
+void handle_connection(server_context *context, int request_socket);
+void *connection_worker(void *argument);
+int image_task_queue_init(image_task_queue *queue, size_t memory_limit);
+void image_task_queue_destroy(image_task_queue *queue);
+bool image_task_queue_accepting(image_task_queue *queue);
+bool image_task_queue_reserve(image_task_queue *queue, size_t upload);
+void image_task_queue_cancel(image_task_queue *queue, size_t upload);
+void image_task_queue_push(image_task_queue *queue, image_task *task);
+image_task *image_task_queue_pop(image_task_queue *queue);
+void image_task_queue_release(image_task_queue *queue, size_t memory);
+void image_task_queue_close(image_task_queue *queue);
+void *image_worker(void *argument);
+time_t monotonic_seconds(void);
+void connection_list_append(connection_list *list, http_connection *connection);
+void connection_list_remove(connection_list *list, http_connection *connection);
+int event_loop_init(event_loop *loop, server_context *context, int server_socket);
+void event_loop_accept(event_loop *loop);
+void event_loop_close_connection(event_loop *loop, http_connection *connection);
+void event_loop_drain(event_loop *loop, http_connection *connection);
+void event_loop_handle(event_loop *loop, http_connection *connection);
+void event_loop_expire(event_loop *loop);
+void *event_loop_worker(void *argument);
 
-ssize_t send_all(int socket, const void *buffer, size_t length, int flags)
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+static uint16_t deflate_fixed_codes[288];
+static uint8_t deflate_fixed_lengths[288];
+static uint16_t deflate_fixed_distance_codes[30];
+static pthread_once_t deflate_tables_once = PTHREAD_ONCE_INIT;
+
+// Fast trades size for speed with a short hash chain and the Sub filter
+// forced on every row; small walks long chains and never stops at a
+// good enough match.
+static const compression_preset compression_presets[COMPRESSION_PRESETS] = {
+    [COMPRESSION_FAST] = { "fast", 4, 4, 16, 1 },
+    [COMPRESSION_BALANCED] = { "balanced", 32, 32, 128, -1 },
+    [COMPRESSION_SMALL] = { "small", 128, 258, 258, -1 }
+};
+
+static _Thread_local slab_cache thread_slabs;
+static pthread_key_t slab_cache_key;
+static pthread_once_t slab_cache_once = PTHREAD_ONCE_INIT;
+static slab_depot slab_shared = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static bool slab_huge_pages = true;
+static atomic_bool slab_hugetlb_unavailable;
+static _Atomic time_t slab_hugetlb_retry_at;
+static slab_statistics slab_stats;
+
+int slab_class(size_t size)
 {
-    const char *ptr = (const char *)buffer;
-    size_t total_sent = 0;
+    // Four classes per power of two, so a block is at most a quarter larger
+    // than asked for. Smaller and larger requests go straight to malloc.
+    if (size <= (size_t)1 << SLAB_MIN_BITS || size > (size_t)1 << SLAB_MAX_BITS) {
+        return -1;
+    }
 
-    while (total_sent < length) {
-        ssize_t sent = send(socket, ptr + total_sent, length - total_sent, flags);
-        if (sent <= 0) {
-            if (sent == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
-                continue;
-            }
-            return sent;
+    size_t last = size - 1;
+    int bits = 63 - __builtin_clzll((unsigned long long)last);
+
+    return 4 * (bits - SLAB_MIN_BITS) + (int)((last >> (bits - 2)) & 3);
+}
+
+size_t slab_class_size(int size_class)
+{
+    return (size_t)(5 + (size_class & 3)) << (size_class / 4 + SLAB_MIN_BITS - 2);
+}
+
+void slab_cache_key_init(void)
+{
+    pthread_key_create(&slab_cache_key, slab_cache_flush);
+}
+
+void slab_cache_flush(void *argument)
+{
+    // A thread's blocks stay cached for the others when it exits.
+    slab_cache *cache = argument;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        while (cache->free_blocks[i] != NULL) {
+            slab_block *block = cache->free_blocks[i];
+            cache->free_blocks[i] = block->next;
+            slab_depot_put(block);
         }
-        total_sent += sent;
+    }
+    cache->cached_bytes = 0;
+}
+
+bool slab_cache_reserve(size_t size)
+{
+    // Counts a block against the one limit shared by every thread's cache
+    // and the depot.
+    size_t cached = atomic_fetch_add_explicit(&slab_stats.cached_bytes, size, memory_order_relaxed);
+    if (cached + size > SLAB_CACHE_MAX_BYTES) {
+        atomic_fetch_sub_explicit(&slab_stats.cached_bytes, size, memory_order_relaxed);
+        return false;
     }
 
-    return total_sent;
+    return true;
 }
 
-void write_image_callback(void *context, void *data, int size)
+slab_block *slab_depot_take(int size_class)
 {
-    buffer_context *ctx = (buffer_context *)context;
-    if (ctx == NULL || ctx->buffer == NULL || ctx->size == NULL || data == NULL || size <= 0) {
-        return;
+    pthread_mutex_lock(&slab_shared.lock);
+    slab_block *block = slab_shared.free_blocks[size_class];
+    if (block != NULL) {
+        slab_shared.free_blocks[size_class] = block->next;
     }
-    if (*(ctx->size) > SIZE_MAX - size) {
-        return;
+    pthread_mutex_unlock(&slab_shared.lock);
+
+    return block;
+}
+
+void slab_depot_put(slab_block *block)
+{
+    pthread_mutex_lock(&slab_shared.lock);
+    block->next = slab_shared.free_blocks[block->size_class];
+    slab_shared.free_blocks[block->size_class] = block;
+    pthread_mutex_unlock(&slab_shared.lock);
+}
+
+void slab_pages_init(void)
+{
+    // Without a hugetlb pool, reserved or on demand, every attempt would
+    // fail, so none is made. A pool that exists but is used up is retried
+    // from time to time in slab_map.
+    long pool = 0;
+    const char *paths[] = { "/proc/sys/vm/nr_hugepages", "/proc/sys/vm/nr_overcommit_hugepages" };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        long pages = 0;
+        FILE *file = fopen(paths[i], "r");
+        if (!file) {
+            return;
+        }
+        if (fscanf(file, "%ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(file);
+        pool += pages;
+    }
+
+    if (pool == 0) {
+        atomic_store_explicit(&slab_hugetlb_unavailable, true, memory_order_relaxed);
+    }
+}
+
+void slab_count_allocation(const slab_block *block)
+{
+    atomic_size_t *counter = &slab_stats.normal_allocations;
+    if (block->pages == SLAB_PAGES_HUGETLB) {
+        counter = &slab_stats.hugetlb_allocations;
+    } else if (block->pages == SLAB_PAGES_TRANSPARENT) {
+        counter = &slab_stats.transparent_allocations;
+    }
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+size_t slab_mapping_size(const slab_block *block)
+{
+    size_t size = block->size_class < 0 ? block->size + sizeof(slab_block) : slab_class_size(block->size_class);
+
+    return (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+}
+
+slab_block *slab_map(size_t length, slab_pages *pages)
+{
+    // Reserved huge pages are used first. The pool pages are set aside when
+    // mapped but faulted in only when touched, so a large reservation such
+    // as a job's output bound costs nothing past what is written. Without a
+    // hugetlb pool the block is aligned to a huge page and offered to
+    // transparent huge pages, which fault in 2 MB at a time; failing that
+    // it stays on normal pages. An exhausted pool is tried again once
+    // HUGETLB_RETRY_SECONDS have passed, when blocks may have been unmapped.
+    if (!atomic_load_explicit(&slab_hugetlb_unavailable, memory_order_relaxed) &&
+        monotonic_seconds() >= atomic_load_explicit(&slab_hugetlb_retry_at, memory_order_relaxed)) {
+        void *memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            atomic_fetch_add_explicit(&slab_stats.hugetlb_mappings, 1, memory_order_relaxed);
+            *pages = SLAB_PAGES_HUGETLB;
+            return memory;
+        }
+        atomic_store_explicit(&slab_hugetlb_retry_at, monotonic_seconds() + HUGETLB_RETRY_SECONDS, memory_order_relaxed);
     }
 
-    size_t new_size = *(ctx->size) + size;
-    unsigned char *new_data = NULL;
-    if (*(ctx->buffer) == NULL) {
-        new_data = (unsigned char *)calloc(1, new_size);
+    unsigned char *memory = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    size_t head = (HUGE_PAGE_SIZE - ((uintptr_t)memory & (HUGE_PAGE_SIZE - 1))) & (HUGE_PAGE_SIZE - 1);
+    if (head > 0) {
+        munmap(memory, head);
+    }
+    munmap(memory + head + length, HUGE_PAGE_SIZE - head);
+    memory += head;
+
+    if (madvise(memory, length, MADV_HUGEPAGE) == 0) {
+        atomic_fetch_add_explicit(&slab_stats.transparent_mappings, 1, memory_order_relaxed);
+        *pages = SLAB_PAGES_TRANSPARENT;
     } else {
-        new_data = (unsigned char *)realloc(*(ctx->buffer), new_size);
+        atomic_fetch_add_explicit(&slab_stats.normal_mappings, 1, memory_order_relaxed);
+        *pages = SLAB_PAGES_NORMAL;
     }
-    if (new_data == NULL) {
-        return;
+
+    return (slab_block *)memory;
+}
+
+void slab_release(slab_block *block)
+{
+    if (block->mapped) {
+        munmap(block, slab_mapping_size(block));
+    } else {
+        free(block);
     }
-    memcpy(new_data + *(ctx->size), data, size);
-    *(ctx->buffer) = new_data;
-    *(ctx->size) = new_size;
 }
 
-int float_compare(const void *a, const void *b)
+void *slab_alloc(size_t size)
 {
-    if (a == NULL || b == NULL) {
-        return 0;
+    // Job buffers are several megabytes and freed in bursts; freed blocks
+    // are kept for the next job instead of being returned to the system and
+    // faulted in again. The thread's own cache is tried first, then the
+    // depot shared by all threads.
+    if (size > SIZE_MAX - sizeof(slab_block)) {
+        return NULL;
     }
-    float fa = *(const float*)a;
-    float fb = *(const float*)b;
-    if (isnan(fa)) {
-        return isnan(fb) ? 0 : 1;
+
+    int size_class = slab_class(size + sizeof(slab_block));
+    slab_block *block = NULL;
+    if (size_class >= 0) {
+        block = thread_slabs.free_blocks[size_class];
+        if (block != NULL) {
+            thread_slabs.free_blocks[size_class] = block->next;
+            thread_slabs.cached_bytes -= slab_class_size(size_class);
+        } else {
+            block = slab_depot_take(size_class);
+        }
+        if (block != NULL) {
+            atomic_fetch_sub_explicit(&slab_stats.cached_bytes, slab_class_size(size_class), memory_order_relaxed);
+            atomic_fetch_add_explicit(&slab_stats.cache_hits, 1, memory_order_relaxed);
+            slab_count_allocation(block);
+            return block + 1;
+        }
+        atomic_fetch_add_explicit(&slab_stats.cache_misses, 1, memory_order_relaxed);
     }
-    if (isnan(fb)) {
-        return -1;
+
+    slab_block header = { .size = size, .size_class = size_class, .mapped = false, .pages = SLAB_PAGES_NORMAL };
+    size_t length = size_class < 0 ? size + sizeof(slab_block) : slab_class_size(size_class);
+    if (slab_huge_pages && length >= HUGE_PAGE_SIZE && length <= SIZE_MAX - HUGE_PAGE_SIZE * 2) {
+        slab_pages pages;
+        header.mapped = true;
+        block = slab_map(slab_mapping_size(&header), &pages);
+        header.pages = pages;
+    }
+    if (!block) {
+        header.mapped = false;
+        header.pages = SLAB_PAGES_NORMAL;
+        block = malloc(length);
+        if (!block) {
+            return NULL;
+        }
+    }
+    *block = header;
+
+    // Allocations small enough to be left to malloc are not counted.
+    if (length > (size_t)1 << SLAB_MIN_BITS) {
+        slab_count_allocation(block);
     }
 
-    return (fa > fb) - (fa < fb);
+    return block + 1;
 }
 
-int setup_server_socket(int *server_socket)
+void *slab_realloc(void *data, size_t size)
 {
-    if (server_socket == NULL) {
-        fprintf(stderr, "Invalid server_socket pointer\n");
-        return EXIT_FAILURE;
+    if (!data) {
+        return slab_alloc(size);
+    }
+    if (size > SIZE_MAX - sizeof(slab_block)) {
+        return NULL;
     }
 
-    *server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (*server_socket == -1) {
-        perror("Failed to create a server socket");
-        return EXIT_FAILURE;
+    slab_block *block = (slab_block *)data - 1;
+    int size_class = slab_class(size + sizeof(slab_block));
+    if (size_class == block->size_class && (size_class >= 0 || !block->mapped)) {
+        if (size_class >= 0) {
+            return data;
+        }
+        slab_block *resized = realloc(block, size + sizeof(slab_block));
+        if (!resized) {
+            return NULL;
+        }
+        resized->size = size;
+        return resized + 1;
     }
 
-    const int reuse = 1;
-    if (setsockopt(*server_socket, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(reuse)) == -1) {
-        perror("Failed to make 0.0.0.0 reusable");
-        close(*server_socket);
-        *server_socket = -1;
-        return EXIT_FAILURE;
+    void *moved = slab_alloc(size);
+    if (!moved) {
+        return NULL;
     }
+    size_t old_size = block->size_class < 0 ? block->size : slab_class_size(block->size_class) - sizeof(slab_block);
+    memcpy(moved, data, old_size < size ? old_size : size);
+    slab_free(data);
 
-#ifdef SO_REUSEPORT
-    if (setsockopt(*server_socket, SOL_SOCKET, SO_REUSEPORT, (const char *) &reuse, sizeof(reuse)) == -1) {
-        perror("Failed to make " TO_STRING(SERVER_PORT) " reusable");
-        close(*server_socket);
-        *server_socket = -1;
+    return moved;
+}
+
+void slab_free(void *data)
+{
+    if (!data) {
+        return;
+    }
+
+    slab_block *block = (slab_block *)data - 1;
+    int size_class = block->size_class;
+    if (size_class < 0 || !slab_cache_reserve(slab_class_size(size_class))) {
+        slab_release(block);
+        return;
+    }
+
+    // A thread keeps only a few blocks of its own, so that one freeing much
+    // more than it allocates, such as the sweeper, passes the rest on.
+    if (thread_slabs.cached_bytes + slab_class_size(size_class) > SLAB_THREAD_CACHE_MAX_BYTES) {
+        slab_depot_put(block);
+        return;
+    }
+
+    // The cache moves to the depot when its thread exits.
+    if (!thread_slabs.registered) {
+        pthread_once(&slab_cache_once, slab_cache_key_init);
+        pthread_setspecific(slab_cache_key, &thread_slabs);
+        thread_slabs.registered = true;
+    }
+    block->next = thread_slabs.free_blocks[size_class];
+    thread_slabs.free_blocks[size_class] = block;
+    thread_slabs.cached_bytes += slab_class_size(size_class);
+}
+
+void buffer_context_init(buffer_context *buffer, unsigned char *slab, size_t slab_size)
+{
+    // A caller-provided slab is written into until it fills up; the buffer
+    // then moves to the heap. The slab itself is never freed here.
+    buffer->data = slab;
+    buffer->size = 0;
+    buffer->capacity = slab != NULL ? slab_size : 0;
+    buffer->borrowed = slab != NULL;
+    buffer->failed = false;
+}
+
+bool buffer_context_reserve(buffer_context *buffer, size_t capacity)
+{
+    if (capacity <= buffer->capacity) {
+        return true;
+    }
+
+    unsigned char *data;
+    if (buffer->borrowed) {
+        data = slab_alloc(capacity);
+        if (data != NULL) {
+            memcpy(data, buffer->data, buffer->size);
+        }
+    } else {
+        data = slab_realloc(buffer->data, capacity);
+    }
+    if (!data) {
+        return false;
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    buffer->borrowed = false;
+
+    return true;
+}
+
+bool buffer_context_append(buffer_context *buffer, const void *data, size_t size)
+{
+    if (buffer->failed) {
+        return false;
+    }
+    if (size > buffer->capacity - buffer->size) {
+        if (size > SIZE_MAX / 2 - buffer->size) {
+            buffer->failed = true;
+            return false;
+        }
+        size_t capacity = buffer->capacity * 2;
+        if (capacity < buffer->size + size) {
+            capacity = buffer->size + size;
+        }
+        if (!buffer_context_reserve(buffer, capacity) && !buffer_context_reserve(buffer, buffer->size + size)) {
+            buffer->failed = true;
+            return false;
+        }
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+
+    return true;
+}
+
+unsigned char *buffer_context_detach(buffer_context *buffer, size_t *size)
+{
+    // Hands the contents over as an exactly sized heap block, or NULL if any
+    // write was lost.
+    if (buffer->failed || buffer->size == 0) {
+        buffer_context_free(buffer);
+        return NULL;
+    }
+
+    unsigned char *data;
+    if (buffer->borrowed) {
+        data = slab_alloc(buffer->size);
+        if (!data) {
+            return NULL;
+        }
+        memcpy(data, buffer->data, buffer->size);
+    } else {
+        data = buffer->data;
+        if (buffer->capacity > buffer->size) {
+            unsigned char *trimmed = slab_realloc(data, buffer->size);
+            if (trimmed != NULL) {
+                data = trimmed;
+            }
+        }
+    }
+    *size = buffer->size;
+    buffer_context_init(buffer, NULL, 0);
+
+    return data;
+}
+
+void buffer_context_free(buffer_context *buffer)
+{
+    if (!buffer->borrowed) {
+        slab_free(buffer->data);
+    }
+    buffer_context_init(buffer, NULL, 0);
+}
+
+size_t png_output_bound(int w, int h, int channels)
+{
+    // Stored deflate blocks bound what the encoder produces: the filtered
+    // rows, five bytes per block and twelve per IDAT chunk, plus the
+    // signature, IHDR, IEND and the zlib header and checksum.
+    size_t raw = (size_t)h * ((size_t)w * channels + 1);
+    size_t blocks = raw / DEFLATE_MAX_STORED_BLOCK + 1;
+    size_t chunks = (raw + blocks * 5 + 6) / PNG_IDAT_SIZE + 1;
+
+    return raw + blocks * 5 + chunks * 12 + 6 + 8 + 25 + 12;
+}
+
+void write_image_callback(void *context, void *data, int size)
+{
+    buffer_context *buffer = (buffer_context *)context;
+    if (buffer == NULL || data == NULL || size <= 0) {
+        return;
+    }
+
+    buffer_context_append(buffer, data, (size_t)size);
+}
+
+int setup_server_socket(int *server_socket)
+{
+    if (server_socket == NULL) {
+        fprintf(stderr, "Invalid server_socket pointer\n");
+        return EXIT_FAILURE;
+    }
+
+    *server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (*server_socket == -1) {
+        perror("Failed to create a server socket");
+        return EXIT_FAILURE;
+    }
+
+    const int reuse = 1;
+    if (setsockopt(*server_socket, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(reuse)) == -1) {
+        perror("Failed to make 0.0.0.0 reusable");
+        close(*server_socket);
+        *server_socket = -1;
+        return EXIT_FAILURE;
+    }
+
+#ifdef SO_REUSEPORT
+    if (setsockopt(*server_socket, SOL_SOCKET, SO_REUSEPORT, (const char *) &reuse, sizeof(reuse)) == -1) {
+        perror("Failed to make " TO_STRING(SERVER_PORT) " reusable");
+        close(*server_socket);
+        *server_socket = -1;
+        return EXIT_FAILURE;
+    }
+#endif
+
+    struct timeval timeout;
+    timeout.tv_sec = 30;
+    timeout.tv_usec = 0;
+
+    if (setsockopt(*server_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
+        perror("Failed to set receive timeout");
+        close(*server_socket);
+        *server_socket = -1;
+        return EXIT_FAILURE;
+    }
+
+    if (setsockopt(*server_socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
+        perror("Failed to set send timeout");
+        close(*server_socket);
+        *server_socket = -1;
+        return EXIT_FAILURE;
+    }
+
+    const int nodelay = 1;
+    if (setsockopt(*server_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1) {
+        perror("Failed to set TCP_NODELAY on server socket");
+        close(*server_socket);
+        *server_socket = -1;
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = INADDR_ANY;
+    server_address.sin_port = htons(SERVER_PORT);
+
+    if (bind(*server_socket, (struct sockaddr *) &server_address, sizeof(server_address)) == -1) {
+        perror("Failed to bind to 0.0.0.0:" TO_STRING(SERVER_PORT));
+        close(*server_socket);
+        *server_socket = -1;
+        return EXIT_FAILURE;
+    }
+
+    if (listen(*server_socket, MAX_QUEUED_CONNECTIONS) == -1) {
+        perror("Failed to start listening for connections");
+        close(*server_socket);
+        *server_socket = -1;
+        return EXIT_FAILURE;
+    }
+
+    puts("The server is listening on 0.0.0.0:" TO_STRING(SERVER_PORT));
+
+    return EXIT_SUCCESS;
+}
+
+io_status receive_request(http_connection *connection)
+{
+    http_request *request = &connection->request;
+
+    // The parser resumes where it stopped, so each fragment is scanned once
+    // and a pipelined request left in the buffer is picked up straight away.
+    while (true) {
+        request->status = http_parse_request(request, connection->request_data, connection->request_size);
+        if (request->status != HTTP_PARSE_INCOMPLETE) {
+            return IO_DONE;
+        }
+        if (connection->request_size == MAX_REQUEST_SIZE) {
+            request->status = HTTP_PARSE_TOO_LARGE;
+            return IO_DONE;
+        }
+
+        ssize_t bytes_received = recv(connection->socket, connection->request_data + connection->request_size, MAX_REQUEST_SIZE - connection->request_size, 0);
+        if (bytes_received == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WANT_READ;
+            }
+            perror("Failed to receive the request data");
+            return IO_ERROR;
+        }
+        if (bytes_received == 0) {
+            if (connection->request_size == 0) {
+                return IO_CLOSED;
+            }
+            request->status = HTTP_PARSE_INVALID;
+            return IO_DONE;
+        }
+
+        connection->request_size += bytes_received;
+        connection->request_data[connection->request_size] = '\0';
+    }
+}
+
+io_status receive_body(http_connection *connection)
+{
+    while (connection->body_size < connection->content_length) {
+        size_t remaining = connection->content_length - connection->body_size;
+        ssize_t bytes_received = recv(connection->socket, connection->body + connection->body_size, remaining, 0);
+        if (bytes_received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WANT_READ;
+            }
+            perror("Error receiving image data");
+            return IO_ERROR;
+        } else if (bytes_received == 0) {
+            fprintf(stderr, "Client disconnected during image upload\n");
+            return IO_CLOSED;
+        }
+        connection->body_size += bytes_received;
+
+        // A malformed image is answered right away instead of after the rest of the upload.
+        if (connection->ingest != NULL && !png_stream_feed(connection->ingest, connection->body, connection->body_size)) {
+            return IO_DONE;
+        }
+    }
+
+    return IO_DONE;
+}
+
+size_t http_scan(const char *data, size_t length, char first, char second)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i first_bytes = _mm_set1_epi8(first);
+    const __m128i second_bytes = _mm_set1_epi8(second);
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        int matches = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, first_bytes), _mm_cmpeq_epi8(chunk, second_bytes))
+        );
+        if (matches != 0) {
+            return i + __builtin_ctz(matches);
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+        if (data[i] == first || data[i] == second) {
+            return i;
+        }
+    }
+
+    return length;
+}
+
+bool http_is_token(const char *data, size_t length)
+{
+    if (length == 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)data[i];
+        if (c <= ' ' || c >= 0x7f || strchr("\"(),/:;<=>?@[\\]{}", c) != NULL) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+http_parse_status http_parse_request_line(http_request *request, const char *line, size_t line_start, size_t line_length)
+{
+    size_t method_length = http_scan(line, line_length, ' ', ' ');
+    if (method_length == line_length || !http_is_token(line, method_length)) {
+        return HTTP_PARSE_INVALID;
+    }
+
+    size_t target_start = method_length + 1;
+    size_t target_length = http_scan(line + target_start, line_length - target_start, ' ', ' ');
+    size_t version_start = target_start + target_length + 1;
+    if (target_length == 0 || version_start > line_length) {
+        return HTTP_PARSE_INVALID;
+    }
+    for (size_t i = target_start; i < target_start + target_length; i++) {
+        if ((unsigned char)line[i] < ' ' || line[i] == 0x7f) {
+            return HTTP_PARSE_INVALID;
+        }
+    }
+
+    const char *version = line + version_start;
+    if (line_length - version_start != 8 || memcmp(version, "HTTP/1.", 7) != 0 || version[7] < '0' || version[7] > '9') {
+        return HTTP_PARSE_INVALID;
+    }
+
+    size_t path_length = http_scan(line + target_start, target_length, '?', '?');
+    request->method = (http_slice){ line_start, method_length };
+    request->path = (http_slice){ line_start + target_start, path_length };
+    if (path_length < target_length) {
+        request->query = (http_slice){ line_start + target_start + path_length + 1, target_length - path_length - 1 };
+    } else {
+        request->query = (http_slice){ line_start + target_start + target_length, 0 };
+    }
+    request->minor_version = version[7] - '0';
+
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+http_parse_status http_parse_header_line(http_request *request, const char *line, size_t line_start, size_t line_length)
+{
+    if (request->header_count == MAX_REQUEST_HEADERS) {
+        return HTTP_PARSE_TOO_LARGE;
+    }
+
+    size_t name_length = http_scan(line, line_length, ':', ':');
+    if (name_length == line_length || !http_is_token(line, name_length)) {
+        return HTTP_PARSE_INVALID;
+    }
+
+    size_t value_start = name_length + 1;
+    size_t value_end = line_length;
+    while (value_start < value_end && (line[value_start] == ' ' || line[value_start] == '\t')) {
+        value_start++;
+    }
+    while (value_end > value_start && (line[value_end - 1] == ' ' || line[value_end - 1] == '\t')) {
+        value_end--;
+    }
+
+    http_header *header = &request->headers[request->header_count++];
+    header->name = (http_slice){ line_start, name_length };
+    header->value = (http_slice){ line_start + value_start, value_end - value_start };
+
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+http_parse_status http_parse_request(http_request *request, char *buffer, size_t size)
+{
+    while (true) {
+        size_t newline = request->scanned + http_scan(buffer + request->scanned, size - request->scanned, '\n', '\n');
+        if (newline == size) {
+            request->scanned = size;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+
+        size_t line_start = request->line_start;
+        size_t line_end = newline > line_start && buffer[newline - 1] == '\r' ? newline - 1 : newline;
+        size_t line_length = line_end - line_start;
+        request->scanned = newline + 1;
+        request->line_start = newline + 1;
+
+        http_parse_status status;
+        if (request->method.length == 0) {
+            // Stray empty lines in front of a request are skipped, as RFC 9112 allows.
+            if (line_length == 0) {
+                continue;
+            }
+            status = http_parse_request_line(request, buffer + line_start, line_start, line_length);
+        } else if (line_length == 0) {
+            request->header_size = newline + 1;
+            break;
+        } else if (buffer[line_start] == ' ' || buffer[line_start] == '\t') {
+            status = HTTP_PARSE_INVALID;
+        } else {
+            status = http_parse_header_line(request, buffer + line_start, line_start, line_length);
+        }
+        if (status != HTTP_PARSE_INCOMPLETE) {
+            return status;
+        }
+    }
+
+    // Terminating every slice in place lets the handlers use them as strings
+    // without copying; the bytes after the header block are left untouched.
+    buffer[request->method.offset + request->method.length] = '\0';
+    buffer[request->path.offset + request->path.length] = '\0';
+    buffer[request->query.offset + request->query.length] = '\0';
+    for (size_t i = 0; i < request->header_count; i++) {
+        http_header *header = &request->headers[i];
+        buffer[header->name.offset + header->name.length] = '\0';
+        buffer[header->value.offset + header->value.length] = '\0';
+    }
+
+    return HTTP_PARSE_DONE;
+}
+
+const char *http_request_header(const http_request *request, const char *buffer, const char *name, size_t *value_length)
+{
+    size_t name_length = strlen(name);
+    for (size_t i = 0; i < request->header_count; i++) {
+        const http_header *header = &request->headers[i];
+        if (header->name.length == name_length && strncasecmp(buffer + header->name.offset, name, name_length) == 0) {
+            *value_length = header->value.length;
+            return buffer + header->value.offset;
+        }
+    }
+
+    return NULL;
+}
+
+const char *connection_header(const http_connection *connection, const char *name, size_t *value_length)
+{
+    return http_request_header(&connection->request, connection->request_data, name, value_length);
+}
+
+bool header_contains_token(const char *value, size_t value_len, const char *token)
+{
+    size_t token_len = strlen(token);
+    const char *value_end = value + value_len;
+
+    while (value < value_end) {
+        const char *item_end = memchr(value, ',', value_end - value);
+        if (item_end == NULL) {
+            item_end = value_end;
+        }
+
+        const char *item = value;
+        const char *item_last = item_end;
+        while (item < item_last && (*item == ' ' || *item == '\t')) {
+            item++;
+        }
+        while (item_last > item && (item_last[-1] == ' ' || item_last[-1] == '\t')) {
+            item_last--;
+        }
+        if ((size_t)(item_last - item) == token_len && strncasecmp(item, token, token_len) == 0) {
+            return true;
+        }
+
+        value = item_end + 1;
+    }
+
+    return false;
+}
+
+int parse_query_parameter(const char *query, const char *name, char *value, size_t value_size)
+{
+    size_t name_len = strlen(name);
+
+    while (*query != '\0') {
+        size_t pair_len = strcspn(query, "&");
+        if (pair_len > name_len && strncmp(query, name, name_len) == 0 && query[name_len] == '=') {
+            size_t value_len = pair_len - name_len - 1;
+            if (value_len >= value_size) {
+                return -1;
+            }
+            memcpy(value, query + name_len + 1, value_len);
+            value[value_len] = '\0';
+            return 1;
+        }
+
+        query += pair_len;
+        if (*query == '&') {
+            query++;
+        }
+    }
+
+    return 0;
+}
+
+void cleanup_connection(int request_socket)
+{
+    if (shutdown(request_socket, SHUT_WR) == -1) {
+        if (errno != ENOTCONN) {
+            perror("Warning: Failed to shutdown write side of socket");
+        }
+    } else {
+        char leftovers[1024];
+        ssize_t bytes_read;
+        struct timeval timeout;
+        timeout.tv_sec = DRAIN_TIMEOUT_SECONDS;
+        timeout.tv_usec = 0;
+        setsockopt(request_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        while ((bytes_read = recv(request_socket, leftovers, sizeof(leftovers), 0)) > 0) {}
+        if (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ETIMEDOUT) {
+            perror("Warning: Failed to drain the socket");
+        }
+        if (shutdown(request_socket, SHUT_RD) == -1) {
+            if (errno != ENOTCONN) {
+                perror("Warning: Failed to shutdown read side of socket");
+            }
+        }
+    }
+
+    if (close(request_socket) == -1) {
+        perror("Warning: Failed to close the socket");
+    }
+}
+
+void cleanup_resources(int request_socket, int server_socket, job_store *jobs)
+{
+    if (request_socket != -1) {
+        cleanup_connection(request_socket);
+    }
+
+    if (server_socket != -1) {
+        close(server_socket);
+    }
+
+    if (jobs != NULL) {
+        job_store_destroy(jobs);
+    }
+}
+
+uint64_t job_id_hash(const uuid_t id)
+{
+    uint64_t high, low;
+    memcpy(&high, id, sizeof(high));
+    memcpy(&low, id + sizeof(high), sizeof(low));
+
+    uint64_t hash = high ^ (low * 0x9e3779b97f4a7c15ULL);
+    hash ^= hash >> 32;
+    hash *= 0xd6e8feb86659fd93ULL;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+job_slots *job_slots_create(size_t capacity)
+{
+    job_slots *slots = malloc(sizeof(*slots) + capacity * sizeof(slots->entries[0]));
+    if (!slots) {
+        return NULL;
+    }
+
+    slots->capacity = capacity;
+    slots->retired = NULL;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&slots->entries[i], NULL);
+    }
+
+    return slots;
+}
+
+void job_slots_place(job_slots *slots, image_job *job)
+{
+    size_t mask = slots->capacity - 1;
+    size_t i = job_id_hash(job->id) & mask;
+    while (atomic_load_explicit(&slots->entries[i], memory_order_relaxed) != NULL) {
+        i = (i + 1) & mask;
+    }
+
+    atomic_store_explicit(&slots->entries[i], job, memory_order_release);
+}
+
+void image_result_release(image_result *result)
+{
+    if (result != NULL && atomic_fetch_sub_explicit(&result->references, 1, memory_order_acq_rel) == 1) {
+        slab_free(result->data);
+        free(result);
+    }
+}
+
+void image_job_free(image_job *job)
+{
+    slab_free(job->original_image);
+    image_result_release(atomic_load_explicit(&job->result, memory_order_relaxed));
+    free(job);
+}
+
+int job_store_init(job_store *store)
+{
+    atomic_init(&store->epoch, 0);
+    atomic_init(&store->readers[0], 0);
+    atomic_init(&store->readers[1], 0);
+
+    for (int i = 0; i < JOB_STORE_SHARDS; i++) {
+        job_shard *shard = &store->shards[i];
+        shard->count = 0;
+
+        job_slots *slots = job_slots_create(JOB_STORE_INITIAL_CAPACITY);
+        if (!slots || pthread_mutex_init(&shard->lock, NULL) != 0) {
+            fprintf(stderr, "Failed to initialize the job store\n");
+            free(slots);
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&store->shards[j].lock);
+                free(atomic_load(&store->shards[j].slots));
+            }
+            return EXIT_FAILURE;
+        }
+        atomic_init(&shard->slots, slots);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void job_store_destroy(job_store *store)
+{
+    for (int i = 0; i < JOB_STORE_SHARDS; i++) {
+        job_shard *shard = &store->shards[i];
+        job_slots *slots = atomic_load(&shard->slots);
+
+        for (size_t j = 0; j < slots->capacity; j++) {
+            image_job *job = atomic_load(&slots->entries[j]);
+            if (job != NULL) {
+                image_job_free(job);
+            }
+        }
+
+        while (slots != NULL) {
+            job_slots *retired = slots->retired;
+            free(slots);
+            slots = retired;
+        }
+
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
+
+int job_store_insert(job_store *store, image_job *job)
+{
+    job_shard *shard = &store->shards[job_id_hash(job->id) >> (64 - JOB_STORE_SHARD_BITS)];
+
+    pthread_mutex_lock(&shard->lock);
+    job_slots *slots = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    if ((shard->count + 1) * 2 > slots->capacity) {
+        job_slots *grown = job_slots_create(slots->capacity * 2);
+        if (!grown) {
+            pthread_mutex_unlock(&shard->lock);
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < slots->capacity; i++) {
+            image_job *existing = atomic_load_explicit(&slots->entries[i], memory_order_relaxed);
+            if (existing != NULL) {
+                job_slots_place(grown, existing);
+            }
+        }
+        grown->retired = slots;
+        atomic_store_explicit(&shard->slots, grown, memory_order_release);
+        slots = grown;
+    }
+
+    job_slots_place(slots, job);
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+
+    return EXIT_SUCCESS;
+}
+
+image_job *job_store_find(job_store *store, const uuid_t id)
+{
+    uint64_t hash = job_id_hash(id);
+    job_shard *shard = &store->shards[hash >> (64 - JOB_STORE_SHARD_BITS)];
+
+    job_slots *slots = atomic_load_explicit(&shard->slots, memory_order_acquire);
+    size_t mask = slots->capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        image_job *job = atomic_load_explicit(&slots->entries[i], memory_order_acquire);
+        if (job == NULL) {
+            return NULL;
+        }
+        if (memcmp(job->id, id, sizeof(uuid_t)) == 0) {
+            return job;
+        }
+    }
+}
+
+unsigned job_store_enter(job_store *store)
+{
+    // Readers announce themselves in the counter of the current epoch and
+    // retry if it moved on in between, so a finished wait covers them.
+    while (true) {
+        unsigned epoch = atomic_load(&store->epoch);
+        atomic_fetch_add(&store->readers[epoch & 1], 1);
+        if (atomic_load(&store->epoch) == epoch) {
+            return epoch;
+        }
+        atomic_fetch_sub(&store->readers[epoch & 1], 1);
+    }
+}
+
+void job_store_leave(job_store *store, unsigned epoch)
+{
+    atomic_fetch_sub_explicit(&store->readers[epoch & 1], 1, memory_order_release);
+}
+
+void job_store_synchronize(job_store *store)
+{
+    // Returns once every reader that could have seen something unpublished
+    // before the call has left. Only the retention sweeper calls this.
+    unsigned epoch = atomic_fetch_add(&store->epoch, 1);
+    while (atomic_load(&store->readers[epoch & 1]) != 0) {
+        sched_yield();
+    }
+}
+
+void job_store_remove(job_store *store, image_job *jobs)
+{
+    // Readers probe without locks, so emptying a slot could cut their probe
+    // chains. Shards are rebuilt without the purged jobs instead, and jobs
+    // left in place when that fails have their purged flag cleared.
+    size_t removing[JOB_STORE_SHARDS] = {0};
+    for (image_job *job = jobs; job != NULL; job = job->next_retired) {
+        job->purged = true;
+        removing[job_id_hash(job->id) >> (64 - JOB_STORE_SHARD_BITS)]++;
+    }
+
+    for (int i = 0; i < JOB_STORE_SHARDS; i++) {
+        if (removing[i] == 0) {
+            continue;
+        }
+        job_shard *shard = &store->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        job_slots *slots = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+        size_t count = shard->count - removing[i];
+        size_t capacity = slots->capacity;
+        while (capacity > JOB_STORE_INITIAL_CAPACITY && count * 4 < capacity) {
+            capacity /= 2;
+        }
+
+        job_slots *rebuilt = job_slots_create(capacity);
+        for (size_t j = 0; j < slots->capacity; j++) {
+            image_job *existing = atomic_load_explicit(&slots->entries[j], memory_order_relaxed);
+            if (existing == NULL) {
+                continue;
+            }
+            if (rebuilt == NULL) {
+                existing->purged = false;
+            } else if (!existing->purged) {
+                job_slots_place(rebuilt, existing);
+            }
+        }
+        if (rebuilt != NULL) {
+            rebuilt->retired = slots;
+            atomic_store_explicit(&shard->slots, rebuilt, memory_order_release);
+            shard->count = count;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+job_slots *job_store_detach_retired(job_store *store)
+{
+    // Takes every table that readers can no longer reach from a new lookup;
+    // they are freed once the readers of the current epoch are gone.
+    job_slots *detached = NULL;
+    for (int i = 0; i < JOB_STORE_SHARDS; i++) {
+        job_shard *shard = &store->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        job_slots *slots = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+        job_slots *retired = slots->retired;
+        slots->retired = NULL;
+        pthread_mutex_unlock(&shard->lock);
+
+        while (retired != NULL) {
+            job_slots *older = retired->retired;
+            retired->retired = detached;
+            detached = retired;
+            retired = older;
+        }
+    }
+
+    return detached;
+}
+
+static inline uint64_t rotate_left64(uint64_t value, int count)
+{
+    return (value << count) | (value >> (64 - count));
+}
+
+static inline uint64_t xxh64_round(uint64_t accumulator, const unsigned char *data)
+{
+    uint64_t lane;
+    memcpy(&lane, data, sizeof(lane));
+
+    return rotate_left64(accumulator + lane * 0xc2b2ae3d27d4eb4fULL, 31) * 0x9e3779b185ebca87ULL;
+}
+
+static inline uint64_t xxh64_merge(uint64_t hash, uint64_t accumulator)
+{
+    hash ^= rotate_left64(accumulator * 0xc2b2ae3d27d4eb4fULL, 31) * 0x9e3779b185ebca87ULL;
+
+    return hash * 0x9e3779b185ebca87ULL + 0x85ebca77c2b2ae63ULL;
+}
+
+uint64_t xxh64(const unsigned char *data, size_t size, uint64_t seed)
+{
+    // XXH64 as specified by xxHash, reading lanes in host byte order.
+    const unsigned char *end = data + size;
+    uint64_t hash;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + 0x9e3779b185ebca87ULL + 0xc2b2ae3d27d4eb4fULL;
+        uint64_t v2 = seed + 0xc2b2ae3d27d4eb4fULL;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - 0x9e3779b185ebca87ULL;
+        for (; end - data >= 32; data += 32) {
+            v1 = xxh64_round(v1, data);
+            v2 = xxh64_round(v2, data + 8);
+            v3 = xxh64_round(v3, data + 16);
+            v4 = xxh64_round(v4, data + 24);
+        }
+        hash = rotate_left64(v1, 1) + rotate_left64(v2, 7) + rotate_left64(v3, 12) + rotate_left64(v4, 18);
+        hash = xxh64_merge(hash, v1);
+        hash = xxh64_merge(hash, v2);
+        hash = xxh64_merge(hash, v3);
+        hash = xxh64_merge(hash, v4);
+    } else {
+        hash = seed + 0x27d4eb2f165667c5ULL;
+    }
+    hash += size;
+
+    for (; end - data >= 8; data += 8) {
+        hash ^= xxh64_round(0, data);
+        hash = rotate_left64(hash, 27) * 0x9e3779b185ebca87ULL + 0x85ebca77c2b2ae63ULL;
+    }
+    if (end - data >= 4) {
+        uint32_t lane;
+        memcpy(&lane, data, sizeof(lane));
+        hash ^= lane * 0x9e3779b185ebca87ULL;
+        hash = rotate_left64(hash, 23) * 0xc2b2ae3d27d4eb4fULL + 0x165667b19e3779f9ULL;
+        data += 4;
+    }
+    for (; data < end; data++) {
+        hash ^= *data * 0x27d4eb2f165667c5ULL;
+        hash = rotate_left64(hash, 11) * 0x9e3779b185ebca87ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xc2b2ae3d27d4eb4fULL;
+    hash ^= hash >> 29;
+    hash *= 0x165667b19e3779f9ULL;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+void result_cache_place(image_job **slots, size_t capacity, image_job *job)
+{
+    size_t mask = capacity - 1;
+    size_t i = job->content_hash & mask;
+    while (slots[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+
+    slots[i] = job;
+}
+
+int result_cache_init(result_cache *cache)
+{
+    cache->capacity = RESULT_CACHE_INITIAL_CAPACITY;
+    cache->count = 0;
+    cache->slots = calloc(cache->capacity, sizeof(*cache->slots));
+    if (!cache->slots || pthread_mutex_init(&cache->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the result cache\n");
+        free(cache->slots);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void result_cache_destroy(result_cache *cache)
+{
+    // The jobs themselves belong to the job store.
+    free(cache->slots);
+    cache->slots = NULL;
+    pthread_mutex_destroy(&cache->lock);
+}
+
+image_job *result_cache_claim(result_cache *cache, image_job *job, bool *shared)
+{
+    // Returns an earlier job with the same upload and settings, or records
+    // this one as the job later duplicates will share. Lookup and insertion
+    // happen under one lock so that simultaneous duplicates agree. A job in
+    // the cache keeps its upload until it is forgotten, so matches are
+    // confirmed on the bytes and a crafted hash collision gains nothing.
+    // A duplicate gives up its upload pointer here, under the lock, so that
+    // a failed job handing its upload on never meets a duplicate's own; the
+    // caller frees the upload. Whether the duplicate was given a finished
+    // result right away is reported through shared, decided under the lock.
+    image_job *origin = NULL;
+    *shared = false;
+
+    pthread_mutex_lock(&cache->lock);
+    size_t mask = cache->capacity - 1;
+    for (size_t i = job->content_hash & mask; cache->slots[i] != NULL; i = (i + 1) & mask) {
+        image_job *candidate = cache->slots[i];
+        if (candidate->content_hash == job->content_hash && candidate->window == job->window &&
+            candidate->compression == job->compression && candidate->original_size == job->original_size &&
+            !atomic_load(&candidate->expired) &&
+            memcmp(candidate->original_image, job->original_image, job->original_size) == 0) {
+            origin = candidate;
+            break;
+        }
+    }
+    if (origin != NULL) {
+        job->original_image = NULL;
+    }
+
+    // A duplicate of a finished job shares its result right away; one of a
+    // job still in progress waits to be handed the result when it is done.
+    // Jobs that failed are never left in the cache.
+    if (origin != NULL && origin->finished) {
+        image_result *result = atomic_load_explicit(&origin->result, memory_order_relaxed);
+        atomic_fetch_add_explicit(&result->references, 1, memory_order_relaxed);
+        atomic_store_explicit(&job->result, result, memory_order_release);
+        job->finished = true;
+        *shared = true;
+    } else if (origin != NULL) {
+        job->next_alias = origin->aliases;
+        origin->aliases = job;
+    }
+
+    if (origin == NULL) {
+        if ((cache->count + 1) * 2 > cache->capacity) {
+            image_job **grown = calloc(cache->capacity * 2, sizeof(*grown));
+            if (grown != NULL) {
+                for (size_t i = 0; i < cache->capacity; i++) {
+                    if (cache->slots[i] != NULL) {
+                        result_cache_place(grown, cache->capacity * 2, cache->slots[i]);
+                    }
+                }
+                free(cache->slots);
+                cache->slots = grown;
+                cache->capacity *= 2;
+            }
+        }
+        // Without room the job simply is not shared.
+        if ((cache->count + 1) * 2 <= cache->capacity) {
+            result_cache_place(cache->slots, cache->capacity, job);
+            cache->count++;
+            job->cached = true;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return origin;
+}
+
+image_job **result_cache_locate(result_cache *cache, const image_job *job)
+{
+    // The caller holds the lock.
+    size_t mask = cache->capacity - 1;
+    for (size_t i = job->content_hash & mask; cache->slots[i] != NULL; i = (i + 1) & mask) {
+        if (cache->slots[i] == job) {
+            return &cache->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+image_job *result_cache_finish(result_cache *cache, image_job *job, image_job **retry)
+{
+    // Marks the job finished and hands its result to the duplicates waiting
+    // on it. The returned list of those duplicates stays valid for the caller.
+    // When the job failed, the first waiting duplicate takes over its upload
+    // and its place in the cache and is returned through retry to be
+    // processed again; with none waiting, the job leaves the cache so that
+    // a later identical upload is tried afresh.
+    *retry = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    job->finished = true;
+    image_result *result = atomic_load_explicit(&job->result, memory_order_relaxed);
+    image_job *aliases = job->aliases;
+    job->aliases = NULL;
+
+    if (result == NULL) {
+        image_job **slot = result_cache_locate(cache, job);
+        if (aliases != NULL && slot != NULL) {
+            image_job *successor = aliases;
+            successor->aliases = successor->next_alias;
+            successor->next_alias = NULL;
+            successor->original_image = job->original_image;
+            successor->cached = true;
+            job->original_image = NULL;
+            job->cached = false;
+            *slot = successor;
+            *retry = successor;
+            aliases = NULL;
+        } else if (slot != NULL) {
+            result_cache_remove(cache, slot);
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        return aliases;
+    }
+
+    for (image_job *alias = aliases; alias != NULL; alias = alias->next_alias) {
+        atomic_fetch_add_explicit(&result->references, 1, memory_order_relaxed);
+        atomic_store_explicit(&alias->result, result, memory_order_release);
+        alias->finished = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return aliases;
+}
+
+void result_cache_remove(result_cache *cache, image_job **slot)
+{
+    // The caller holds the lock.
+    (*slot)->cached = false;
+    *slot = NULL;
+    cache->count--;
+
+    // Everything after the hole in its cluster is placed again so later
+    // lookups still reach it.
+    size_t mask = cache->capacity - 1;
+    for (size_t i = (slot - cache->slots + 1) & mask; cache->slots[i] != NULL; i = (i + 1) & mask) {
+        image_job *displaced = cache->slots[i];
+        cache->slots[i] = NULL;
+        result_cache_place(cache->slots, cache->capacity, displaced);
+    }
+}
+
+void result_cache_forget(result_cache *cache, image_job *job)
+{
+    pthread_mutex_lock(&cache->lock);
+    image_job **slot = result_cache_locate(cache, job);
+    if (slot != NULL) {
+        result_cache_remove(cache, slot);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void job_list_push(job_list *list, image_job *job)
+{
+    job_link *link = &job->links[list->kind];
+    link->older = list->newest;
+    link->newer = NULL;
+    if (list->newest != NULL) {
+        list->newest->links[list->kind].newer = job;
+    } else {
+        list->oldest = job;
+    }
+    list->newest = job;
+}
+
+void job_list_remove(job_list *list, image_job *job)
+{
+    job_link *link = &job->links[list->kind];
+    if (link->older != NULL) {
+        link->older->links[list->kind].newer = link->newer;
+    } else {
+        list->oldest = link->newer;
+    }
+    if (link->newer != NULL) {
+        link->newer->links[list->kind].older = link->older;
+    } else {
+        list->newest = link->older;
+    }
+    link->older = NULL;
+    link->newer = NULL;
+}
+
+int job_retention_init(job_retention *retention, job_store *jobs, result_cache *results, size_t byte_limit, time_t ttl)
+{
+    retention->recent = (job_list){ NULL, NULL, JOB_LIST_ACCESS };
+    retention->finished = (job_list){ NULL, NULL, JOB_LIST_AGE };
+    retention->expired = (job_list){ NULL, NULL, JOB_LIST_AGE };
+    retention->retained = 0;
+    retention->retained_bytes = 0;
+    retention->tombstones = 0;
+    retention->byte_limit = byte_limit;
+    retention->ttl = ttl;
+    retention->jobs = jobs;
+    retention->results = results;
+    retention->closed = false;
+
+    pthread_condattr_t attributes;
+    if (pthread_condattr_init(&attributes) != 0) {
+        fprintf(stderr, "Failed to initialize the job retention\n");
+        return EXIT_FAILURE;
+    }
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&retention->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the job retention\n");
+        pthread_condattr_destroy(&attributes);
+        return EXIT_FAILURE;
+    }
+    if (pthread_cond_init(&retention->wake, &attributes) != 0) {
+        fprintf(stderr, "Failed to initialize the job retention\n");
+        pthread_condattr_destroy(&attributes);
+        pthread_mutex_destroy(&retention->lock);
+        return EXIT_FAILURE;
+    }
+    pthread_condattr_destroy(&attributes);
+
+    int error = pthread_create(&retention->sweeper, NULL, job_retention_worker, retention);
+    if (error != 0) {
+        fprintf(stderr, "Failed to start the job retention sweeper: %s\n", strerror(error));
+        pthread_cond_destroy(&retention->wake);
+        pthread_mutex_destroy(&retention->lock);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void job_retention_destroy(job_retention *retention)
+{
+    // The jobs themselves belong to the job store.
+    pthread_mutex_lock(&retention->lock);
+    retention->closed = true;
+    pthread_cond_signal(&retention->wake);
+    pthread_mutex_unlock(&retention->lock);
+
+    pthread_join(retention->sweeper, NULL);
+    pthread_cond_destroy(&retention->wake);
+    pthread_mutex_destroy(&retention->lock);
+}
+
+void job_retention_add(job_retention *retention, image_job *job)
+{
+    image_result *result = atomic_load_explicit(&job->result, memory_order_relaxed);
+    time_t now = monotonic_seconds();
+
+    pthread_mutex_lock(&retention->lock);
+    job->finished_at = now;
+    job->listed_at = now;
+    atomic_store_explicit(&job->accessed, now, memory_order_relaxed);
+    // Duplicates sharing a result are each charged for it, which keeps the
+    // total an upper bound. An upload kept for comparison counts as well.
+    job->charge = result != NULL ? result->size : 0;
+    if (job->original_image != NULL) {
+        job->charge += job->original_size;
+    }
+    job_list_push(&retention->recent, job);
+    job_list_push(&retention->finished, job);
+    retention->retained++;
+    retention->retained_bytes += job->charge;
+    if (retention->retained_bytes > retention->byte_limit) {
+        pthread_cond_signal(&retention->wake);
+    }
+    pthread_mutex_unlock(&retention->lock);
+}
+
+void job_retention_expire(job_retention *retention, image_job *job, time_t now, image_job **expiring)
+{
+    job_list_remove(&retention->recent, job);
+    job_list_remove(&retention->finished, job);
+    retention->retained--;
+    retention->retained_bytes -= job->charge;
+
+    // The job stays behind as a tombstone so that its ID answers 410 Gone.
+    job->expired_at = now;
+    atomic_store(&job->expired, true);
+    job_list_push(&retention->expired, job);
+    retention->tombstones++;
+
+    job->next_retired = *expiring;
+    *expiring = job;
+}
+
+void job_retention_sweep(job_retention *retention, time_t now, image_job **expiring, image_job **purging)
+{
+    image_job *job;
+    while ((job = retention->finished.oldest) != NULL && now - job->finished_at >= retention->ttl) {
+        job_retention_expire(retention, job, now, expiring);
+    }
+
+    // Least recently read results go first. Reads only stamp the job, so a
+    // job read since it was last placed gets one more turn at the front.
+    size_t second_chances = retention->retained;
+    while (retention->retained_bytes > retention->byte_limit && (job = retention->recent.oldest) != NULL) {
+        time_t accessed = atomic_load_explicit(&job->accessed, memory_order_relaxed);
+        if (accessed != job->listed_at && second_chances > 0) {
+            second_chances--;
+            job->listed_at = accessed;
+            job_list_remove(&retention->recent, job);
+            job_list_push(&retention->recent, job);
+            continue;
+        }
+        job_retention_expire(retention, job, now, expiring);
+    }
+
+    while ((job = retention->expired.oldest) != NULL && now - job->expired_at >= TOMBSTONE_SECONDS) {
+        job_list_remove(&retention->expired, job);
+        retention->tombstones--;
+        job->next_retired = *purging;
+        *purging = job;
+    }
+}
+
+void job_retention_reclaim(job_retention *retention, image_job *expiring, image_job *purging)
+{
+    // Once forgotten, nothing compares against the upload any more.
+    for (image_job *job = expiring; job != NULL; job = job->next_retired) {
+        result_cache_forget(retention->results, job);
+        slab_free(job->original_image);
+        job->original_image = NULL;
+    }
+    job_store_remove(retention->jobs, purging);
+    job_slots *retired = job_store_detach_retired(retention->jobs);
+
+    // Readers check the expired flag before taking a result, and look jobs
+    // up only in published tables, so after this wait nothing else can reach
+    // what is freed below.
+    job_store_synchronize(retention->jobs);
+
+    for (image_job *job = expiring; job != NULL; job = job->next_retired) {
+        image_result_release(atomic_exchange_explicit(&job->result, NULL, memory_order_relaxed));
+    }
+
+    image_job *kept = NULL;
+    while (purging != NULL) {
+        image_job *job = purging;
+        purging = job->next_retired;
+        if (job->purged) {
+            image_job_free(job);
+        } else {
+            job->next_retired = kept;
+            kept = job;
+        }
+    }
+
+    while (retired != NULL) {
+        job_slots *older = retired->retired;
+        free(retired);
+        retired = older;
+    }
+
+    if (kept != NULL) {
+        pthread_mutex_lock(&retention->lock);
+        for (image_job *job = kept; job != NULL; job = job->next_retired) {
+            job_list_push(&retention->expired, job);
+            retention->tombstones++;
+        }
+        pthread_mutex_unlock(&retention->lock);
+    }
+}
+
+void *job_retention_worker(void *argument)
+{
+    job_retention *retention = (job_retention *)argument;
+
+    pthread_mutex_lock(&retention->lock);
+    while (!retention->closed) {
+        image_job *expiring = NULL;
+        image_job *purging = NULL;
+        job_retention_sweep(retention, monotonic_seconds(), &expiring, &purging);
+        pthread_mutex_unlock(&retention->lock);
+
+        job_retention_reclaim(retention, expiring, purging);
+
+        pthread_mutex_lock(&retention->lock);
+        if (retention->closed || retention->retained_bytes > retention->byte_limit) {
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += RETENTION_SWEEP_SECONDS;
+        pthread_cond_timedwait(&retention->wake, &retention->lock, &deadline);
+    }
+    pthread_mutex_unlock(&retention->lock);
+
+    return NULL;
+}
+
+const char *static_file_content_type(const char *path)
+{
+    static const struct
+    {
+        const char *extension;
+        const char *content_type;
+    } content_types[] = {
+        { ".html", "text/html; charset=utf-8" },
+        { ".htm",  "text/html; charset=utf-8" },
+        { ".css",  "text/css; charset=utf-8" },
+        { ".js",   "text/javascript; charset=utf-8" },
+        { ".json", "application/json" },
+        { ".txt",  "text/plain; charset=utf-8" },
+        { ".png",  "image/png" },
+        { ".jpg",  "image/jpeg" },
+        { ".jpeg", "image/jpeg" },
+        { ".gif",  "image/gif" },
+        { ".svg",  "image/svg+xml" },
+        { ".ico",  "image/x-icon" },
+    };
+
+    const char *extension = strrchr(path, '.');
+    if (extension != NULL && strchr(extension, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+            if (strcasecmp(extension, content_types[i].extension) == 0) {
+                return content_types[i].content_type;
+            }
+        }
+    }
+
+    return "application/octet-stream";
+}
+
+int format_static_file_header(char *header, size_t header_size, const char *path, const struct stat *file_status)
+{
+    struct tm modified;
+    char last_modified[64];
+    if (gmtime_r(&file_status->st_mtim.tv_sec, &modified) == NULL ||
+        strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &modified) == 0) {
+        return -1;
+    }
+
+    unsigned long long modified_ns =
+        (unsigned long long)file_status->st_mtim.tv_sec * 1000000000ULL + (unsigned long long)file_status->st_mtim.tv_nsec;
+    int written = snprintf(
+        header, header_size,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %lld\r\n"
+        "ETag: \"%llx-%llx\"\r\n"
+        "Last-Modified: %s\r\n"
+        "\r\n",
+        static_file_content_type(path),
+        (long long)file_status->st_size,
+        modified_ns, (unsigned long long)file_status->st_size,
+        last_modified
+    );
+    if (written < 0 || (size_t)written >= header_size) {
+        return -1;
+    }
+
+    return written;
+}
+
+uint64_t static_path_hash(const char *path, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static_file *static_file_load(const static_cache *cache, const char *path)
+{
+    char file_path[PATH_MAX + 1];
+    int path_len_required = snprintf(file_path, sizeof(file_path), "%s%s", cache->root, path);
+    if (path_len_required < 0 || (size_t)path_len_required >= sizeof(file_path)) {
+        return NULL;
+    }
+
+    int file_handle = open(file_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (file_handle == -1) {
+        return NULL;
+    }
+
+    static_file *file = NULL;
+    struct stat file_status;
+    if (fstat(file_handle, &file_status) == -1 || !S_ISREG(file_status.st_mode) ||
+        file_status.st_size > STATIC_CACHE_MAX_FILE_SIZE) {
+        goto end;
+    }
+
+    char header[MAX_RESPONSE_HEADER_SIZE];
+    int header_size = format_static_file_header(header, sizeof(header), path, &file_status);
+    if (header_size < 0) {
+        goto end;
+    }
+
+    // The entry, its key, its header, and its bytes share one allocation.
+    size_t path_len = strlen(path);
+    size_t size = file_status.st_size;
+    file = malloc(sizeof(*file) + path_len + 1 + header_size + size);
+    if (!file) {
+        goto end;
+    }
+
+    atomic_init(&file->references, 1);
+    file->path = (char *)(file + 1);
+    file->path_len = path_len;
+    file->header = file->path + path_len + 1;
+    file->header_size = header_size;
+    file->data = (unsigned char *)file->header + header_size;
+    file->size = size;
+    memcpy(file->path, path, path_len + 1);
+    memcpy(file->header, header, header_size);
+
+    size_t total_read = 0;
+    while (total_read < size) {
+        ssize_t bytes_read = read(file_handle, file->data + total_read, size - total_read);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            // The file shrank or failed under us; the next inotify event reloads it.
+            free(file);
+            file = NULL;
+            goto end;
+        }
+        total_read += bytes_read;
+    }
+
+end:
+    close(file_handle);
+    return file;
+}
+
+void static_file_release(static_file *file)
+{
+    if (file != NULL && atomic_fetch_sub_explicit(&file->references, 1, memory_order_acq_rel) == 1) {
+        free(file);
+    }
+}
+
+void static_cache_place(static_file **slots, size_t capacity, static_file *file)
+{
+    size_t mask = capacity - 1;
+    size_t i = static_path_hash(file->path, file->path_len) & mask;
+    while (slots[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+
+    slots[i] = file;
+}
+
+static_file *static_cache_replace(static_cache *cache, const char *path, static_file *file)
+{
+    size_t path_len = strlen(path);
+    uint64_t hash = static_path_hash(path, path_len);
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    size_t mask = cache->capacity - 1;
+    size_t i = hash & mask;
+    while (cache->slots[i] != NULL &&
+           (cache->slots[i]->path_len != path_len || memcmp(cache->slots[i]->path, path, path_len) != 0)) {
+        i = (i + 1) & mask;
+    }
+    static_file *previous = cache->slots[i];
+    size_t previous_size = previous != NULL ? previous->size : 0;
+
+    if (file != NULL && cache->cached_bytes - previous_size + file->size > STATIC_CACHE_MAX_SIZE) {
+        // Over budget: drop the stale entry and let the file be served from disk.
+        static_file_release(file);
+        file = NULL;
+    }
+
+    if (file != NULL && previous != NULL) {
+        cache->slots[i] = file;
+    } else if (file != NULL) {
+        if ((cache->count + 1) * 2 > cache->capacity) {
+            static_file **grown = calloc(cache->capacity * 2, sizeof(*grown));
+            if (!grown) {
+                pthread_rwlock_unlock(&cache->lock);
+                static_file_release(file);
+                return NULL;
+            }
+            for (size_t j = 0; j < cache->capacity; j++) {
+                if (cache->slots[j] != NULL) {
+                    static_cache_place(grown, cache->capacity * 2, cache->slots[j]);
+                }
+            }
+            free(cache->slots);
+            cache->slots = grown;
+            cache->capacity *= 2;
+        }
+        static_cache_place(cache->slots, cache->capacity, file);
+        cache->count++;
+    } else if (previous != NULL) {
+        // Backward-shift deletion keeps every probe chain unbroken without tombstones.
+        cache->slots[i] = NULL;
+        for (size_t j = (i + 1) & mask; cache->slots[j] != NULL; j = (j + 1) & mask) {
+            size_t home = static_path_hash(cache->slots[j]->path, cache->slots[j]->path_len) & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                cache->slots[i] = cache->slots[j];
+                cache->slots[j] = NULL;
+                i = j;
+            }
+        }
+        cache->count--;
+    }
+
+    cache->cached_bytes = cache->cached_bytes - previous_size + (file != NULL ? file->size : 0);
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    return previous;
+}
+
+void static_cache_reload(static_cache *cache, const char *path)
+{
+    static_file_release(static_cache_replace(cache, path, static_file_load(cache, path)));
+}
+
+void static_cache_evict_directory(static_cache *cache, const char *directory, bool unwatch)
+{
+    size_t directory_len = strlen(directory);
+    static_file **evicted = NULL;
+    size_t evicted_count = 0;
+
+    pthread_rwlock_wrlock(&cache->lock);
+    static_file **slots = calloc(cache->capacity, sizeof(*slots));
+    evicted = malloc((cache->count + 1) * sizeof(*evicted));
+    if (slots != NULL && evicted != NULL) {
+        for (size_t i = 0; i < cache->capacity; i++) {
+            static_file *file = cache->slots[i];
+            if (file == NULL) {
+                continue;
+            }
+            if (strncmp(file->path, directory, directory_len) == 0 && file->path[directory_len] == '/') {
+                cache->cached_bytes -= file->size;
+                cache->count--;
+                evicted[evicted_count++] = file;
+            } else {
+                static_cache_place(slots, cache->capacity, file);
+            }
+        }
+        free(cache->slots);
+        cache->slots = slots;
+    } else {
+        free(slots);
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    for (size_t i = 0; i < evicted_count; i++) {
+        static_file_release(evicted[i]);
+    }
+    free(evicted);
+
+    if (!unwatch) {
+        return;
+    }
+    for (size_t wd = 0; wd < cache->watched_dirs_capacity; wd++) {
+        const char *watched = cache->watched_dirs[wd];
+        if (watched != NULL && strncmp(watched, directory, directory_len) == 0 &&
+            (watched[directory_len] == '/' || watched[directory_len] == '\0')) {
+            inotify_rm_watch(cache->inotify_handle, (int)wd);
+        }
+    }
+}
+
+void static_cache_watch(static_cache *cache, const char *directory)
+{
+    char directory_path[PATH_MAX + 1];
+    int path_len_required = snprintf(directory_path, sizeof(directory_path), "%s%s", cache->root, directory);
+    if (path_len_required < 0 || (size_t)path_len_required >= sizeof(directory_path)) {
+        return;
+    }
+
+    int wd = inotify_add_watch(
+        cache->inotify_handle, directory_path,
+        IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW
+    );
+    if (wd == -1) {
+        perror("Failed to watch a static directory for changes");
+        return;
+    }
+
+    if ((size_t)wd >= cache->watched_dirs_capacity) {
+        size_t capacity = cache->watched_dirs_capacity > 0 ? cache->watched_dirs_capacity : 16;
+        while (capacity <= (size_t)wd) {
+            capacity *= 2;
+        }
+        char **grown = realloc(cache->watched_dirs, capacity * sizeof(*grown));
+        if (!grown) {
+            inotify_rm_watch(cache->inotify_handle, wd);
+            return;
+        }
+        memset(grown + cache->watched_dirs_capacity, 0, (capacity - cache->watched_dirs_capacity) * sizeof(*grown));
+        cache->watched_dirs = grown;
+        cache->watched_dirs_capacity = capacity;
+    }
+
+    free(cache->watched_dirs[wd]);
+    cache->watched_dirs[wd] = strdup(directory);
+}
+
+void static_cache_scan(static_cache *cache, const char *directory)
+{
+    static_cache_watch(cache, directory);
+
+    char directory_path[PATH_MAX + 1];
+    int path_len_required = snprintf(directory_path, sizeof(directory_path), "%s%s", cache->root, directory);
+    if (path_len_required < 0 || (size_t)path_len_required >= sizeof(directory_path)) {
+        return;
+    }
+
+    DIR *entries = opendir(directory_path);
+    if (!entries) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(entries)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char path[PATH_MAX + 1];
+        path_len_required = snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if (path_len_required < 0 || (size_t)path_len_required >= sizeof(path)) {
+            continue;
+        }
+
+        // Symbolic links are left to the request path, which checks where they resolve to.
+        struct stat entry_status;
+        if (fstatat(dirfd(entries), entry->d_name, &entry_status, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        if (S_ISDIR(entry_status.st_mode)) {
+            static_cache_scan(cache, path);
+        } else if (S_ISREG(entry_status.st_mode)) {
+            static_cache_reload(cache, path);
+        }
+    }
+
+    closedir(entries);
+}
+
+static_file *static_cache_find(static_cache *cache, const char *path)
+{
+    size_t path_len = strlen(path);
+    uint64_t hash = static_path_hash(path, path_len);
+    static_file *file = NULL;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    size_t mask = cache->capacity - 1;
+    for (size_t i = hash & mask; cache->slots[i] != NULL; i = (i + 1) & mask) {
+        static_file *candidate = cache->slots[i];
+        if (candidate->path_len == path_len && memcmp(candidate->path, path, path_len) == 0) {
+            atomic_fetch_add_explicit(&candidate->references, 1, memory_order_relaxed);
+            file = candidate;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    return file;
+}
+
+void *static_cache_worker(void *argument)
+{
+    static_cache *cache = (static_cache *)argument;
+
+    char events[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t events_size = read(cache->inotify_handle, events, sizeof(events));
+        if (events_size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read static file changes");
+            return NULL;
+        }
+
+        // Finish the whole batch before shutdown can cancel us in the middle of an update.
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        for (char *ptr = events; ptr < events + events_size; ) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                static_cache_evict_directory(cache, "", false);
+                static_cache_scan(cache, "");
+                continue;
+            }
+            if (event->wd < 0 || (size_t)event->wd >= cache->watched_dirs_capacity ||
+                cache->watched_dirs[event->wd] == NULL) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                free(cache->watched_dirs[event->wd]);
+                cache->watched_dirs[event->wd] = NULL;
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+
+            char path[PATH_MAX + 1];
+            int path_len_required = snprintf(path, sizeof(path), "%s/%s", cache->watched_dirs[event->wd], event->name);
+            if (path_len_required < 0 || (size_t)path_len_required >= sizeof(path)) {
+                continue;
+            }
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    static_cache_evict_directory(cache, path, true);
+                } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    static_cache_scan(cache, path);
+                }
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                static_file_release(static_cache_replace(cache, path, NULL));
+            } else {
+                static_cache_reload(cache, path);
+            }
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+int static_cache_init(static_cache *cache, const char *root)
+{
+    cache->root = root;
+    cache->capacity = STATIC_CACHE_INITIAL_CAPACITY;
+    cache->count = 0;
+    cache->cached_bytes = 0;
+    cache->watched_dirs = NULL;
+    cache->watched_dirs_capacity = 0;
+    cache->watching = false;
+
+    cache->slots = calloc(cache->capacity, sizeof(*cache->slots));
+    if (!cache->slots) {
+        perror("Failed to allocate the static file cache");
+        return EXIT_FAILURE;
+    }
+    if (pthread_rwlock_init(&cache->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the static file cache lock\n");
+        free(cache->slots);
+        return EXIT_FAILURE;
+    }
+
+    // Without change notifications the cache could serve stale files forever,
+    // so it stays empty and every request goes to the disk instead.
+    cache->inotify_handle = inotify_init1(IN_CLOEXEC);
+    if (cache->inotify_handle == -1) {
+        perror("Failed to watch " SERVER_DIR " for changes, static files will not be cached");
+        return EXIT_SUCCESS;
+    }
+
+    static_cache_scan(cache, "");
+
+    int error = pthread_create(&cache->watcher, NULL, static_cache_worker, cache);
+    if (error != 0) {
+        fprintf(stderr, "Failed to start the static file watcher: %s\n", strerror(error));
+        static_cache_destroy(cache);
+        return EXIT_FAILURE;
+    }
+    cache->watching = true;
+
+    return EXIT_SUCCESS;
+}
+
+void static_cache_destroy(static_cache *cache)
+{
+    if (cache->watching) {
+        pthread_cancel(cache->watcher);
+        pthread_join(cache->watcher, NULL);
+        cache->watching = false;
+    }
+    if (cache->inotify_handle != -1) {
+        close(cache->inotify_handle);
+        cache->inotify_handle = -1;
+    }
+
+    for (size_t i = 0; i < cache->capacity; i++) {
+        static_file_release(cache->slots[i]);
+    }
+    free(cache->slots);
+    cache->slots = NULL;
+
+    for (size_t i = 0; i < cache->watched_dirs_capacity; i++) {
+        free(cache->watched_dirs[i]);
+    }
+    free(cache->watched_dirs);
+    cache->watched_dirs = NULL;
+    cache->watched_dirs_capacity = 0;
+
+    pthread_rwlock_destroy(&cache->lock);
+}
+
+static inline unsigned char min_u8(unsigned char a, unsigned char b)
+{
+    return a < b ? a : b;
+}
+
+static inline unsigned char max_u8(unsigned char a, unsigned char b)
+{
+    return a > b ? a : b;
+}
+
+static inline unsigned char median3_u8(unsigned char a, unsigned char b, unsigned char c)
+{
+    return max_u8(min_u8(a, b), min_u8(max_u8(a, b), c));
+}
+
+static inline int clamp_int(int value, int low, int high)
+{
+    return value < low ? low : (value > high ? high : value);
+}
+
+static inline unsigned char median9_columns(const unsigned char *above, const unsigned char *center, const unsigned char *below, size_t left, size_t j, size_t right)
+{
+    size_t columns[3] = { left, j, right };
+    unsigned char low[3], mid[3], high[3];
+    for (int k = 0; k < 3; k++) {
+        unsigned char a = above[columns[k]], b = center[columns[k]], c = below[columns[k]];
+        unsigned char ab_low = min_u8(a, b), ab_high = max_u8(a, b);
+        low[k] = min_u8(ab_low, c);
+        high[k] = max_u8(ab_high, c);
+        mid[k] = max_u8(ab_low, min_u8(ab_high, c));
+    }
+
+    unsigned char max_low = max_u8(max_u8(low[0], low[1]), low[2]);
+    unsigned char min_high = min_u8(min_u8(high[0], high[1]), high[2]);
+    unsigned char med_mid = median3_u8(mid[0], mid[1], mid[2]);
+
+    return median3_u8(max_low, med_mid, min_high);
+}
+
+void median_filter_row_edges(const unsigned char *above, const unsigned char *center, const unsigned char *below, unsigned char *out_row, int w, int channels)
+{
+    for (int x = 0; x < w; x += (w > 1 ? w - 1 : 1)) {
+        size_t left = (size_t)clamp_int(x - 1, 0, w - 1) * channels;
+        size_t right = (size_t)clamp_int(x + 1, 0, w - 1) * channels;
+        for (int c = 0; c < channels; c++) {
+            size_t j = (size_t)x * channels + c;
+            out_row[j] = median9_columns(above, center, below, left + c, j, right + c);
+        }
+    }
+}
+
+void median_filter_rows_network(const unsigned char *const *rows, unsigned char *out, int w, int channels, int row_count, unsigned char *scratch)
+{
+    size_t columns = (size_t)w * channels;
+    unsigned char *low = scratch;
+    unsigned char *mid = scratch + columns;
+    unsigned char *high = scratch + 2 * columns;
+
+    for (int y = 0; y < row_count; y++) {
+        const unsigned char *above = rows[y];
+        const unsigned char *center = rows[y + 1];
+        const unsigned char *below = rows[y + 2];
+        unsigned char *out_row = out + (size_t)y * columns;
+
+        for (size_t j = 0; j < columns; j++) {
+            unsigned char a = above[j], b = center[j], c = below[j];
+            unsigned char ab_low = min_u8(a, b), ab_high = max_u8(a, b);
+            low[j] = min_u8(ab_low, c);
+            high[j] = max_u8(ab_high, c);
+            mid[j] = max_u8(ab_low, min_u8(ab_high, c));
+        }
+
+        median_filter_row_edges(above, center, below, out_row, w, channels);
+
+        for (size_t j = channels; j + channels < columns; j++) {
+            unsigned char max_low = max_u8(max_u8(low[j - channels], low[j]), low[j + channels]);
+            unsigned char min_high = min_u8(min_u8(high[j - channels], high[j]), high[j + channels]);
+            unsigned char med_mid = median3_u8(mid[j - channels], mid[j], mid[j + channels]);
+            out_row[j] = median3_u8(max_low, med_mid, min_high);
+        }
+    }
+}
+
+void median_histogram_row(const uint16_t (*column_fine)[256], const uint16_t (*column_coarse)[16], unsigned char *out_row, int w, int channels, int channel, int radius)
+{
+    int window = 2 * radius + 1;
+    int target = (window * window) / 2;
+
+    uint16_t coarse[16] = {0};
+    uint16_t fine[16][16];
+    int updated_at[16];
+    for (int b = 0; b < 16; b++) {
+        updated_at[b] = INT_MIN;
+    }
+
+    for (int dx = -radius; dx <= radius; dx++) {
+        size_t column = (size_t)clamp_int(dx, 0, w - 1) * channels + channel;
+        for (int b = 0; b < 16; b++) {
+            coarse[b] += column_coarse[column][b];
+        }
+    }
+
+    for (int x = 0; x < w; x++) {
+        if (x > 0) {
+            size_t added = (size_t)clamp_int(x + radius, 0, w - 1) * channels + channel;
+            size_t removed = (size_t)clamp_int(x - radius - 1, 0, w - 1) * channels + channel;
+            if (added != removed) {
+                for (int b = 0; b < 16; b++) {
+                    coarse[b] = coarse[b] + column_coarse[added][b] - column_coarse[removed][b];
+                }
+            }
+        }
+
+        int count = 0;
+        int bin = 0;
+        while (count + coarse[bin] <= target) {
+            count += coarse[bin];
+            bin++;
+        }
+
+        uint16_t *fine_bin = fine[bin];
+        if (updated_at[bin] == INT_MIN || 2 * (x - updated_at[bin]) > window) {
+            memset(fine_bin, 0, sizeof(fine[bin]));
+            for (int dx = -radius; dx <= radius; dx++) {
+                const uint16_t *column = column_fine[(size_t)clamp_int(x + dx, 0, w - 1) * channels + channel] + bin * 16;
+                for (int i = 0; i < 16; i++) {
+                    fine_bin[i] += column[i];
+                }
+            }
+        } else {
+            for (int t = updated_at[bin] + 1; t <= x; t++) {
+                size_t added = (size_t)clamp_int(t + radius, 0, w - 1) * channels + channel;
+                size_t removed = (size_t)clamp_int(t - radius - 1, 0, w - 1) * channels + channel;
+                if (added == removed) {
+                    continue;
+                }
+                const uint16_t *added_column = column_fine[added] + bin * 16;
+                const uint16_t *removed_column = column_fine[removed] + bin * 16;
+                for (int i = 0; i < 16; i++) {
+                    fine_bin[i] = fine_bin[i] + added_column[i] - removed_column[i];
+                }
+            }
+        }
+        updated_at[bin] = x;
+
+        int value = 0;
+        while (count + fine_bin[value] <= target) {
+            count += fine_bin[value];
+            value++;
+        }
+
+        out_row[(size_t)x * channels + channel] = (unsigned char)(bin * 16 + value);
+    }
+}
+
+#ifdef MEDIAN_X86_SIMD
+__attribute__((target("sse2")))
+void median_filter_rows_sse2(const unsigned char *const *rows, unsigned char *out, int w, int channels, int row_count)
+{
+    size_t columns = (size_t)w * channels;
+    size_t step = channels;
+
+    for (int y = 0; y < row_count; y++) {
+        const unsigned char *above = rows[y];
+        const unsigned char *center = rows[y + 1];
+        const unsigned char *below = rows[y + 2];
+        unsigned char *out_row = out + (size_t)y * columns;
+
+        median_filter_row_edges(above, center, below, out_row, w, channels);
+
+        size_t j = step;
+        for (; j + sizeof(__m128i) + step <= columns; j += sizeof(__m128i)) {
+            __m128i low[3], mid[3], high[3];
+            for (int k = 0; k < 3; k++) {
+                size_t column = j + k * step - step;
+                __m128i a = _mm_loadu_si128((const __m128i *)(above + column));
+                __m128i b = _mm_loadu_si128((const __m128i *)(center + column));
+                __m128i c = _mm_loadu_si128((const __m128i *)(below + column));
+                __m128i ab_low = _mm_min_epu8(a, b);
+                __m128i ab_high = _mm_max_epu8(a, b);
+                low[k] = _mm_min_epu8(ab_low, c);
+                high[k] = _mm_max_epu8(ab_high, c);
+                mid[k] = _mm_max_epu8(ab_low, _mm_min_epu8(ab_high, c));
+            }
+
+            __m128i max_low = _mm_max_epu8(_mm_max_epu8(low[0], low[1]), low[2]);
+            __m128i min_high = _mm_min_epu8(_mm_min_epu8(high[0], high[1]), high[2]);
+            __m128i med_mid = _mm_max_epu8(_mm_min_epu8(mid[0], mid[1]), _mm_min_epu8(_mm_max_epu8(mid[0], mid[1]), mid[2]));
+            __m128i median = _mm_max_epu8(_mm_min_epu8(max_low, med_mid), _mm_min_epu8(_mm_max_epu8(max_low, med_mid), min_high));
+            _mm_storeu_si128((__m128i *)(out_row + j), median);
+        }
+
+        for (; j + step < columns; j++) {
+            out_row[j] = median9_columns(above, center, below, j - step, j, j + step);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void median_filter_rows_avx2(const unsigned char *const *rows, unsigned char *out, int w, int channels, int row_count)
+{
+    size_t columns = (size_t)w * channels;
+    size_t step = channels;
+
+    for (int y = 0; y < row_count; y++) {
+        const unsigned char *above = rows[y];
+        const unsigned char *center = rows[y + 1];
+        const unsigned char *below = rows[y + 2];
+        unsigned char *out_row = out + (size_t)y * columns;
+
+        median_filter_row_edges(above, center, below, out_row, w, channels);
+
+        size_t j = step;
+        for (; j + sizeof(__m256i) + step <= columns; j += sizeof(__m256i)) {
+            __m256i low[3], mid[3], high[3];
+            for (int k = 0; k < 3; k++) {
+                size_t column = j + k * step - step;
+                __m256i a = _mm256_loadu_si256((const __m256i *)(above + column));
+                __m256i b = _mm256_loadu_si256((const __m256i *)(center + column));
+                __m256i c = _mm256_loadu_si256((const __m256i *)(below + column));
+                __m256i ab_low = _mm256_min_epu8(a, b);
+                __m256i ab_high = _mm256_max_epu8(a, b);
+                low[k] = _mm256_min_epu8(ab_low, c);
+                high[k] = _mm256_max_epu8(ab_high, c);
+                mid[k] = _mm256_max_epu8(ab_low, _mm256_min_epu8(ab_high, c));
+            }
+
+            __m256i max_low = _mm256_max_epu8(_mm256_max_epu8(low[0], low[1]), low[2]);
+            __m256i min_high = _mm256_min_epu8(_mm256_min_epu8(high[0], high[1]), high[2]);
+            __m256i med_mid = _mm256_max_epu8(_mm256_min_epu8(mid[0], mid[1]), _mm256_min_epu8(_mm256_max_epu8(mid[0], mid[1]), mid[2]));
+            __m256i median = _mm256_max_epu8(_mm256_min_epu8(max_low, med_mid), _mm256_min_epu8(_mm256_max_epu8(max_low, med_mid), min_high));
+            _mm256_storeu_si256((__m256i *)(out_row + j), median);
+        }
+
+        for (; j + step < columns; j++) {
+            out_row[j] = median9_columns(above, center, below, j - step, j, j + step);
+        }
+    }
+}
+#endif
+
+int median_filter_rows_histogram(const unsigned char *const *rows, unsigned char *out, int w, int channels, int radius, int row_count)
+{
+    size_t columns = (size_t)w * channels;
+    uint16_t (*column_fine)[256] = calloc(columns, sizeof(*column_fine));
+    uint16_t (*column_coarse)[16] = calloc(columns, sizeof(*column_coarse));
+    if (!column_fine || !column_coarse) {
+        free(column_fine);
+        free(column_coarse);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < 2 * radius + 1; i++) {
+        for (size_t j = 0; j < columns; j++) {
+            unsigned char value = rows[i][j];
+            column_fine[j][value]++;
+            column_coarse[j][value >> 4]++;
+        }
+    }
+
+    for (int y = 0; y < row_count; y++) {
+        if (y > 0) {
+            const unsigned char *removed = rows[y - 1];
+            const unsigned char *added = rows[y + 2 * radius];
+            for (size_t j = 0; j < columns; j++) {
+                if (removed[j] == added[j]) {
+                    continue;
+                }
+                column_fine[j][removed[j]]--;
+                column_coarse[j][removed[j] >> 4]--;
+                column_fine[j][added[j]]++;
+                column_coarse[j][added[j] >> 4]++;
+            }
+        }
+
+        unsigned char *out_row = out + (size_t)y * columns;
+        for (int c = 0; c < channels; c++) {
+            median_histogram_row((const uint16_t (*)[256])column_fine, (const uint16_t (*)[16])column_coarse, out_row, w, channels, c, radius);
+        }
+    }
+
+    free(column_fine);
+    free(column_coarse);
+
+    return EXIT_SUCCESS;
+}
+
+int median_filter_rows(const unsigned char *const *rows, unsigned char *out, int w, int channels, int radius, int row_count)
+{
+    size_t columns = (size_t)w * channels;
+
+    if (radius == 0) {
+        for (int y = 0; y < row_count; y++) {
+            memcpy(out + (size_t)y * columns, rows[y], columns);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (2 * radius + 1 <= MEDIAN_NETWORK_MAX_WINDOW) {
+#ifdef MEDIAN_X86_SIMD
+        if (__builtin_cpu_supports("avx2")) {
+            median_filter_rows_avx2(rows, out, w, channels, row_count);
+            return EXIT_SUCCESS;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            median_filter_rows_sse2(rows, out, w, channels, row_count);
+            return EXIT_SUCCESS;
+        }
+#endif
+        unsigned char *scratch = malloc(3 * columns);
+        if (!scratch) {
+            return EXIT_FAILURE;
+        }
+        median_filter_rows_network(rows, out, w, channels, row_count, scratch);
+        free(scratch);
+        return EXIT_SUCCESS;
+    }
+
+    return median_filter_rows_histogram(rows, out, w, channels, radius, row_count);
+}
+
+int band_pool_init(band_pool *pool, int worker_count)
+{
+    memset(pool, 0, sizeof(*pool));
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->next_deque, 0);
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the band pool lock\n");
+        return EXIT_FAILURE;
+    }
+    if (pthread_cond_init(&pool->work_available, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the band pool condition\n");
+        pthread_mutex_destroy(&pool->lock);
+        return EXIT_FAILURE;
+    }
+
+    pool->deques = calloc(worker_count, sizeof(band_deque));
+    pool->threads = calloc(worker_count, sizeof(pthread_t));
+    if (!pool->deques || !pool->threads) {
+        perror("Failed to allocate the band pool");
+        band_pool_destroy(pool);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        band_deque *deque = &pool->deques[i];
+        deque->pool = pool;
+        deque->index = i;
+        if (pthread_mutex_init(&deque->lock, NULL) != 0) {
+            fprintf(stderr, "Failed to initialize a band deque lock\n");
+            band_pool_destroy(pool);
+            return EXIT_FAILURE;
+        }
+        pool->worker_count++;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        int error = pthread_create(&pool->threads[i], NULL, band_worker, &pool->deques[i]);
+        if (error != 0) {
+            fprintf(stderr, "Failed to start a band thread: %s\n", strerror(error));
+            band_pool_destroy(pool);
+            return EXIT_FAILURE;
+        }
+        pool->started++;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void band_pool_destroy(band_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+
+    free(pool->threads);
+    free(pool->deques);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof(*pool));
+}
+
+int band_deque_push(band_deque *deque, band_task *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 16;
+        band_task **tasks = malloc(capacity * sizeof(*tasks));
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->top = 0;
+    }
+
+    deque->tasks[(deque->top + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+
+    return EXIT_SUCCESS;
+}
+
+band_task *band_deque_pop(band_deque *deque, bool steal)
+{
+    band_task *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        if (steal) {
+            task = deque->tasks[deque->top];
+            deque->top = (deque->top + 1) % deque->capacity;
+        } else {
+            task = deque->tasks[(deque->top + deque->count - 1) % deque->capacity];
+        }
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
+
+band_task *band_pool_take(band_pool *pool, int own_index)
+{
+    band_task *task = NULL;
+    if (own_index >= 0) {
+        task = band_deque_pop(&pool->deques[own_index], false);
+    }
+
+    int start = own_index >= 0 ? own_index + 1 : 0;
+    for (int i = 0; task == NULL && i < pool->worker_count; i++) {
+        int victim = (start + i) % pool->worker_count;
+        if (victim != own_index) {
+            task = band_deque_pop(&pool->deques[victim], true);
+        }
+    }
+
+    if (task != NULL) {
+        atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_relaxed);
+    }
+
+    return task;
+}
+
+void band_task_run(band_task *task)
+{
+    int status;
+    if (task->run != NULL) {
+        status = task->run(task->argument);
+    } else {
+        status = median_filter_rows(task->rows, task->out, task->w, task->channels, task->radius, task->row_count);
+    }
+
+    band_batch *batch = task->batch;
+    pthread_mutex_lock(&batch->lock);
+    if (status != EXIT_SUCCESS) {
+        batch->status = status;
+    }
+    batch->remaining--;
+    if (batch->remaining == 0) {
+        pthread_cond_signal(&batch->finished);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+void *band_worker(void *argument)
+{
+    band_deque *deque = (band_deque *)argument;
+    band_pool *pool = deque->pool;
+
+    while (true) {
+        band_task *task = band_pool_take(pool, deque->index);
+        if (task != NULL) {
+            band_task_run(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (atomic_load_explicit(&pool->pending, memory_order_relaxed) == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->work_available, &pool->lock);
+        }
+        bool stopping = pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+        if (stopping) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int band_pool_run(band_pool *pool, band_task *tasks, int count)
+{
+    band_batch batch;
+    batch.remaining = count;
+    batch.status = EXIT_SUCCESS;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+
+    size_t first_deque = atomic_fetch_add_explicit(&pool->next_deque, 1, memory_order_relaxed);
+    int queued = 0;
+    for (int i = 0; i < count; i++) {
+        band_task *task = &tasks[i];
+        task->batch = &batch;
+        if (band_deque_push(&pool->deques[(first_deque + i) % pool->worker_count], task) == EXIT_SUCCESS) {
+            queued++;
+        } else {
+            band_task_run(task);
+        }
+    }
+
+    atomic_fetch_add_explicit(&pool->pending, queued, memory_order_relaxed);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    band_task *task;
+    while ((task = band_pool_take(pool, -1)) != NULL) {
+        band_task_run(task);
+    }
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.remaining > 0) {
+        pthread_cond_wait(&batch.finished, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    pthread_cond_destroy(&batch.finished);
+    pthread_mutex_destroy(&batch.lock);
+
+    return batch.status;
+}
+
+int band_pool_filter(band_pool *pool, const unsigned char *const *rows, unsigned char *out, int w, int h, int channels, int radius)
+{
+    int band_rows = h / (pool->worker_count * BAND_TASKS_PER_THREAD);
+    int min_band_rows = MIN_BAND_ROWS > 4 * (2 * radius + 1) ? MIN_BAND_ROWS : 4 * (2 * radius + 1);
+    if (band_rows < min_band_rows) {
+        band_rows = min_band_rows;
+    }
+    int band_count = (h + band_rows - 1) / band_rows;
+    if (band_count < 2) {
+        return median_filter_rows(rows, out, w, channels, radius, h);
+    }
+
+    band_task *tasks = calloc(band_count, sizeof(*tasks));
+    if (!tasks) {
+        return median_filter_rows(rows, out, w, channels, radius, h);
+    }
+
+    size_t stride = (size_t)w * channels;
+    for (int i = 0; i < band_count; i++) {
+        int y = i * band_rows;
+        band_task *task = &tasks[i];
+        task->rows = rows + y;
+        task->out = out + (size_t)y * stride;
+        task->w = w;
+        task->channels = channels;
+        task->radius = radius;
+        task->row_count = y + band_rows <= h ? band_rows : h - y;
+    }
+
+    int result = band_pool_run(pool, tasks, band_count);
+    free(tasks);
+
+    return result;
+}
+
+void crc32_table_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xedb88320U & (0U - (crc & 1)));
+        }
+        crc32_table[i] = crc;
+    }
+}
+
+#ifdef PNG_X86_SIMD
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_fold_pclmul(uint32_t crc, const unsigned char *data, size_t size)
+{
+    // Folds 64 bytes at a time with carry-less multiplies and reduces the
+    // remainder with Barrett reduction, after Intel's "Fast CRC Computation
+    // Using PCLMULQDQ". The constants are for the reflected gzip polynomial;
+    // SSE4.2's crc32 instruction computes CRC-32C and cannot be used here.
+    // Takes a pre-inverted crc and a size that is a multiple of 16, >= 64.
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    data += 64;
+    size -= 64;
+
+    while (size >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 0x30)));
+        data += 64;
+        size -= 64;
+    }
+
+    __m128i folded[3] = { x2, x3, x4 };
+    for (int i = 0; i < 3; i++) {
+        __m128i low = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, folded[i]), low);
+    }
+    while (size >= 16) {
+        __m128i low = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)data)), low);
+        data += 16;
+        size -= 16;
+    }
+
+    __m128i upper = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), upper);
+    upper = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, upper);
+
+    upper = _mm_and_si128(x1, mask);
+    upper = _mm_clmulepi64_si128(upper, poly, 0x10);
+    upper = _mm_and_si128(upper, mask);
+    upper = _mm_clmulepi64_si128(upper, poly, 0x00);
+    x1 = _mm_xor_si128(x1, upper);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+__attribute__((target("ssse3")))
+uint32_t adler32_update_ssse3(uint32_t adler, const unsigned char *data, size_t size)
+{
+    // Takes 32 bytes per step: psadbw adds them up for the first sum and
+    // pmaddubsw weights them 32..1 for the second. Size is a multiple of 32.
+    const __m128i taps_high = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i taps_low = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    size_t blocks = size / 32;
+
+    while (blocks > 0) {
+        // 5552 / 32 steps keep the second sum within 32 bits.
+        size_t steps = blocks < 173 ? blocks : 173;
+        blocks -= steps;
+
+        __m128i previous_sums = _mm_cvtsi32_si128((int)(a * steps));
+        __m128i sum_a = zero;
+        __m128i sum_b = _mm_cvtsi32_si128((int)b);
+        for (size_t i = 0; i < steps; i++) {
+            __m128i high = _mm_loadu_si128((const __m128i *)data);
+            __m128i low = _mm_loadu_si128((const __m128i *)(data + 16));
+            previous_sums = _mm_add_epi32(previous_sums, sum_a);
+            sum_a = _mm_add_epi32(sum_a, _mm_add_epi32(_mm_sad_epu8(high, zero), _mm_sad_epu8(low, zero)));
+            sum_b = _mm_add_epi32(sum_b, _mm_madd_epi16(_mm_maddubs_epi16(high, taps_high), ones));
+            sum_b = _mm_add_epi32(sum_b, _mm_madd_epi16(_mm_maddubs_epi16(low, taps_low), ones));
+            data += 32;
+        }
+        sum_b = _mm_add_epi32(sum_b, _mm_slli_epi32(previous_sums, 5));
+
+        sum_a = _mm_add_epi32(sum_a, _mm_shuffle_epi32(sum_a, _MM_SHUFFLE(2, 3, 0, 1)));
+        sum_a = _mm_add_epi32(sum_a, _mm_shuffle_epi32(sum_a, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum_b = _mm_add_epi32(sum_b, _mm_shuffle_epi32(sum_b, _MM_SHUFFLE(2, 3, 0, 1)));
+        sum_b = _mm_add_epi32(sum_b, _mm_shuffle_epi32(sum_b, _MM_SHUFFLE(1, 0, 3, 2)));
+        a = (a + (uint32_t)_mm_cvtsi128_si32(sum_a)) % 65521;
+        b = (uint32_t)_mm_cvtsi128_si32(sum_b) % 65521;
+    }
+
+    return (b << 16) | a;
+}
+#endif
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t size)
+{
+    crc = ~crc;
+#ifdef PNG_X86_SIMD
+    if (size >= 64 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        size_t folded = size & ~(size_t)15;
+        crc = crc32_fold_pclmul(crc, data, folded);
+        data += folded;
+        size -= folded;
+    }
+#endif
+    for (size_t i = 0; i < size; i++) {
+        crc = crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+uint32_t adler32_update(uint32_t adler, const unsigned char *data, size_t size)
+{
+#ifdef PNG_X86_SIMD
+    if (size >= 64 && __builtin_cpu_supports("ssse3")) {
+        size_t vectored = size & ~(size_t)31;
+        adler = adler32_update_ssse3(adler, data, vectored);
+        data += vectored;
+        size -= vectored;
+    }
+#endif
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+
+    while (size > 0) {
+        // 5552 is the longest run for which b cannot overflow 32 bits.
+        size_t block = size < 5552 ? size : 5552;
+        for (size_t i = 0; i < block; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += block;
+        size -= block;
+    }
+
+    return (b << 16) | a;
+}
+
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size)
+{
+    // Sums of two pieces compressed separately are merged without rereading
+    // the data: the second one is shifted by the length it covers.
+    uint32_t remainder = (uint32_t)(second_size % 65521);
+    uint32_t a = (first & 0xffff) + (second & 0xffff) + 65521 - 1;
+    uint32_t b = (uint32_t)(((uint64_t)remainder * (first & 0xffff)) % 65521) + (first >> 16) + (second >> 16) + 65521 - remainder;
+    a %= 65521;
+    b %= 65521;
+
+    return (b << 16) | a;
+}
+
+static const uint16_t deflate_length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t deflate_length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t deflate_distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t deflate_distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static inline int bit_reverse(int code, int length)
+{
+    int reversed = 0;
+    for (int i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+
+    return reversed;
+}
+
+bool inflate_build_huffman(inflate_huffman *table, const uint8_t *lengths, int count)
+{
+    int counts[16] = {0};
+    int next_code[16];
+
+    memset(table->fast, 0, sizeof(table->fast));
+    for (int i = 0; i < count; i++) {
+        counts[lengths[i]]++;
+    }
+    counts[0] = 0;
+
+    int code = 0;
+    int symbol = 0;
+    for (int i = 1; i < 16; i++) {
+        next_code[i] = code;
+        table->first_code[i] = (uint16_t)code;
+        table->first_symbol[i] = (uint16_t)symbol;
+        code += counts[i];
+        if (counts[i] != 0 && code - 1 >= (1 << i)) {
+            return false;
+        }
+        table->max_code[i] = (uint32_t)code << (16 - i);
+        code <<= 1;
+        symbol += counts[i];
+    }
+    table->max_code[16] = 0x10000;
+
+    for (int i = 0; i < count; i++) {
+        int length = lengths[i];
+        if (length == 0) {
+            continue;
+        }
+
+        int slot = next_code[length] - table->first_code[length] + table->first_symbol[length];
+        table->size[slot] = (uint8_t)length;
+        table->value[slot] = (uint16_t)i;
+        if (length <= INFLATE_FAST_BITS) {
+            for (int j = bit_reverse(next_code[length], length); j < (1 << INFLATE_FAST_BITS); j += 1 << length) {
+                table->fast[j] = (uint16_t)((length << 9) | i);
+            }
+        }
+        next_code[length]++;
+    }
+
+    return true;
+}
+
+static inline void inflate_refill(inflater *z)
+{
+    while (z->bit_count <= 56) {
+        uint64_t byte;
+        if (z->position < z->input_size) {
+            byte = z->input[z->position++];
+        } else if (z->input_final) {
+            // Past the end of the last chunk the stream reads as zeros; any of
+            // those bits actually consumed marks the stream as truncated.
+            byte = 0;
+            z->overrun++;
+        } else {
+            return;
+        }
+        z->bits |= byte << z->bit_count;
+        z->bit_count += 8;
+    }
+}
+
+static inline uint32_t inflate_take(inflater *z, int count)
+{
+    if (z->bit_count < count) {
+        inflate_refill(z);
+        if (z->bit_count < count) {
+            z->starved = true;
+            return 0;
+        }
+    }
+
+    uint32_t value = (uint32_t)(z->bits & ((1ULL << count) - 1));
+    z->bits >>= count;
+    z->bit_count -= count;
+
+    return value;
+}
+
+static inline int inflate_decode(inflater *z, const inflate_huffman *table)
+{
+    if (z->bit_count < 16) {
+        inflate_refill(z);
+    }
+
+    int length;
+    int symbol;
+    int fast = table->fast[z->bits & ((1 << INFLATE_FAST_BITS) - 1)];
+    if (fast != 0) {
+        length = fast >> 9;
+        symbol = fast & 511;
+    } else {
+        uint32_t code = (uint32_t)bit_reverse((int)(z->bits & 0xffff), 16);
+        for (length = INFLATE_FAST_BITS + 1; code >= table->max_code[length]; length++) {}
+        if (length >= 16) {
+            return -1;
+        }
+        int slot = (int)(code >> (16 - length)) - table->first_code[length] + table->first_symbol[length];
+        if (slot >= INFLATE_MAX_SYMBOLS || table->size[slot] != length) {
+            return -1;
+        }
+        symbol = table->value[slot];
+    }
+
+    if (z->bit_count < length) {
+        z->starved = true;
+        return -1;
+    }
+    z->bits >>= length;
+    z->bit_count -= length;
+
+    return symbol;
+}
+
+static inline size_t inflate_available_bits(const inflater *z)
+{
+    return (size_t)z->bit_count + 8 * (z->input_size - z->position);
+}
+
+static inline bool inflate_overran(const inflater *z)
+{
+    return z->overrun * 8 > (size_t)z->bit_count;
+}
+
+bool inflate_read_dynamic_tables(inflater *z)
+{
+    static const uint8_t length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    int literal_count = (int)inflate_take(z, 5) + 257;
+    int distance_count = (int)inflate_take(z, 5) + 1;
+    int code_length_count = (int)inflate_take(z, 4) + 4;
+    if (literal_count > 286 || distance_count > 30) {
+        return false;
+    }
+
+    uint8_t code_lengths[19] = {0};
+    for (int i = 0; i < code_length_count; i++) {
+        code_lengths[length_order[i]] = (uint8_t)inflate_take(z, 3);
+    }
+
+    inflate_huffman code_length_table;
+    if (!inflate_build_huffman(&code_length_table, code_lengths, 19)) {
+        return false;
+    }
+
+    uint8_t lengths[286 + 30];
+    int total = literal_count + distance_count;
+    for (int i = 0; i < total; ) {
+        int symbol = inflate_decode(z, &code_length_table);
+        if (symbol < 0 || z->starved) {
+            return false;
+        }
+        if (symbol < 16) {
+            lengths[i++] = (uint8_t)symbol;
+            continue;
+        }
+
+        int repeat;
+        uint8_t value = 0;
+        if (symbol == 16) {
+            if (i == 0) {
+                return false;
+            }
+            repeat = 3 + (int)inflate_take(z, 2);
+            value = lengths[i - 1];
+        } else if (symbol == 17) {
+            repeat = 3 + (int)inflate_take(z, 3);
+        } else {
+            repeat = 11 + (int)inflate_take(z, 7);
+        }
+        if (i + repeat > total) {
+            return false;
+        }
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+
+    return inflate_build_huffman(&z->lengths, lengths, literal_count) &&
+           inflate_build_huffman(&z->distances, lengths + literal_count, distance_count);
+}
+
+void inflate_build_fixed_tables(inflater *z)
+{
+    uint8_t lengths[288];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    inflate_build_huffman(&z->lengths, lengths, 288);
+
+    memset(lengths, 5, 30);
+    inflate_build_huffman(&z->distances, lengths, 30);
+}
+
+void inflate_init(inflater *z, unsigned char *output, size_t output_size)
+{
+    memset(z, 0, sizeof(*z));
+    z->state = INFLATE_ZLIB_HEADER;
+    z->output = output;
+    z->output_size = output_size;
+}
+
+inflate_result inflate_run_header(inflater *z)
+{
+    // Headers are read whole or not at all: when the input runs dry in the
+    // middle of one, the reader rewinds to its start and waits for more.
+    inflate_state state = z->state;
+    size_t position = z->position;
+    uint64_t bits = z->bits;
+    int bit_count = z->bit_count;
+    size_t overrun = z->overrun;
+
+    bool valid = true;
+    switch (z->state) {
+        case INFLATE_ZLIB_HEADER: {
+            uint32_t method = inflate_take(z, 8);
+            uint32_t flags = inflate_take(z, 8);
+            valid = (method & 0x0f) == 8 && (method >> 4) <= 7 && (method * 256 + flags) % 31 == 0 && (flags & 0x20) == 0;
+            z->state = INFLATE_BLOCK_HEADER;
+            break;
+        }
+        case INFLATE_BLOCK_HEADER: {
+            z->final_block = inflate_take(z, 1) != 0;
+            uint32_t type = inflate_take(z, 2);
+            if (type == 0) {
+                inflate_take(z, z->bit_count % 8);
+                uint32_t length = inflate_take(z, 16);
+                uint32_t complement = inflate_take(z, 16);
+                valid = (length ^ 0xffff) == complement;
+                z->stored_remaining = length;
+                z->state = INFLATE_STORED;
+            } else if (type == 1) {
+                inflate_build_fixed_tables(z);
+                z->state = INFLATE_HUFFMAN;
+            } else if (type == 2) {
+                valid = inflate_read_dynamic_tables(z);
+                z->state = INFLATE_HUFFMAN;
+            } else {
+                valid = false;
+            }
+#if INFLATE_FAST_LOOP
+            if (valid && z->state == INFLATE_HUFFMAN) {
+                inflate_build_literal_table(z);
+            }
+#endif
+            break;
+        }
+        case INFLATE_TRAILER: {
+            inflate_take(z, z->bit_count % 8);
+            uint32_t checksum = 0;
+            for (int i = 0; i < 4; i++) {
+                checksum = (checksum << 8) | inflate_take(z, 8);
+            }
+            z->expected_adler = checksum;
+            z->state = INFLATE_DONE;
+            break;
+        }
+        default:
+            break;
+    }
+
+    if (z->starved || inflate_overran(z)) {
+        if (z->input_final) {
+            return INFLATE_CORRUPT;
+        }
+        z->state = state;
+        z->position = position;
+        z->bits = bits;
+        z->bit_count = bit_count;
+        z->overrun = overrun;
+        z->starved = false;
+        return INFLATE_NEED_INPUT;
+    }
+
+    return valid ? INFLATE_OK : INFLATE_CORRUPT;
+}
+
+#if INFLATE_FAST_LOOP
+void inflate_build_literal_table(inflater *z)
+{
+    // Each entry holds what the next INFLATE_FAST_BITS bits decode to: one
+    // symbol, or two literals when both codes fit, as in libdeflate. The
+    // length is in the low byte, the count in the next, the symbols above.
+    const uint16_t *fast = z->lengths.fast;
+    for (int i = 0; i < 1 << INFLATE_FAST_BITS; i++) {
+        int first = fast[i];
+        if (first == 0) {
+            z->literals[i] = 0;
+            continue;
+        }
+        int length = first >> 9;
+        int symbol = first & 511;
+        z->literals[i] = (uint32_t)length | 1U << 8 | (uint32_t)symbol << 16;
+        if (symbol >= 256) {
+            continue;
+        }
+
+        int second = fast[i >> length];
+        if (second != 0 && (second >> 9) <= INFLATE_FAST_BITS - length && (second & 511) < 256) {
+            z->literals[i] = (uint32_t)(length + (second >> 9)) | 2U << 8 | (uint32_t)symbol << 16 | (uint32_t)(second & 511) << 24;
+        }
+    }
+}
+
+static inline void inflate_refill_word(inflater *z)
+{
+    // Loads eight bytes at once and keeps the whole ones that fit, so the
+    // buffer holds at least 56 bits afterwards.
+    uint64_t word;
+    memcpy(&word, z->input + z->position, sizeof(word));
+    z->bits |= word << z->bit_count;
+    z->position += (63 - z->bit_count) >> 3;
+    z->bit_count |= 56;
+}
+
+bool inflate_run_fast(inflater *z)
+{
+    // Runs while a whole symbol is certain to be in the input and its
+    // match to fit in the output, so neither needs checking per symbol
+    // and matches may be copied a word at a time past their end.
+    unsigned char *output = z->output;
+    size_t position = z->output_position;
+    bool valid = true;
+
+    while (z->input_size - z->position >= INFLATE_FAST_INPUT_MARGIN &&
+           z->output_size - position >= INFLATE_FAST_OUTPUT_MARGIN) {
+        inflate_refill_word(z);
+
+        int symbol;
+        uint32_t entry = z->literals[z->bits & ((1 << INFLATE_FAST_BITS) - 1)];
+        if (entry != 0) {
+            z->bits >>= entry & 0xff;
+            z->bit_count -= (int)(entry & 0xff);
+            if ((entry >> 8 & 0xff) == 2) {
+                output[position] = (unsigned char)(entry >> 16);
+                output[position + 1] = (unsigned char)(entry >> 24);
+                position += 2;
+                continue;
+            }
+            symbol = (int)(entry >> 16);
+        } else {
+            symbol = inflate_decode(z, &z->lengths);
+        }
+
+        if (symbol < 256) {
+            if (symbol < 0) {
+                valid = false;
+                break;
+            }
+            output[position++] = (unsigned char)symbol;
+            continue;
+        }
+        if (symbol == 256) {
+            z->state = z->final_block ? INFLATE_TRAILER : INFLATE_BLOCK_HEADER;
+            break;
+        }
+
+        symbol -= 257;
+        if (symbol >= 29) {
+            valid = false;
+            break;
+        }
+        size_t length = deflate_length_base[symbol] + inflate_take(z, deflate_length_extra[symbol]);
+        int distance_symbol = inflate_decode(z, &z->distances);
+        if (distance_symbol < 0 || distance_symbol >= 30) {
+            valid = false;
+            break;
+        }
+        size_t distance = deflate_distance_base[distance_symbol] + inflate_take(z, deflate_distance_extra[distance_symbol]);
+        if (distance > position) {
+            valid = false;
+            break;
+        }
+
+        unsigned char *out = output + position;
+        const unsigned char *from = out - distance;
+        if (distance >= 8) {
+            for (size_t i = 0; i < length; i += 8) {
+                uint64_t word;
+                memcpy(&word, from + i, sizeof(word));
+                memcpy(out + i, &word, sizeof(word));
+            }
+        } else if (distance == 1) {
+            memset(out, from[0], length);
+        } else {
+            for (size_t i = 0; i < length; i++) {
+                out[i] = from[i];
+            }
+        }
+        position += length;
+    }
+
+    // The word loads leave bytes beyond the counted bits in the buffer,
+    // which the byte-wise reader expects to be zero.
+    z->bits &= (1ULL << z->bit_count) - 1;
+    z->output_position = position;
+
+    return valid;
+}
+#endif
+
+inflate_result inflate_run(inflater *z, const unsigned char *input, size_t input_size, bool input_final)
+{
+    z->input = input;
+    z->input_size = input_size;
+    z->input_final = input_final;
+
+    // Keep only the last window of output once the consumer has seen it all,
+    // which is as far back as a match can reach.
+    if (z->output_position > z->output_size - INFLATE_MAX_MATCH) {
+        memmove(z->output, z->output + z->output_position - INFLATE_WINDOW_SIZE, INFLATE_WINDOW_SIZE);
+        z->output_position = INFLATE_WINDOW_SIZE;
+    }
+    z->output_start = z->output_position;
+
+    while (true) {
+        switch (z->state) {
+            case INFLATE_ZLIB_HEADER:
+            case INFLATE_BLOCK_HEADER:
+            case INFLATE_TRAILER: {
+                inflate_result result = inflate_run_header(z);
+                if (result != INFLATE_OK) {
+                    return result;
+                }
+                break;
+            }
+            case INFLATE_STORED:
+                while (z->stored_remaining > 0) {
+                    if (z->output_position == z->output_size) {
+                        return INFLATE_OK;
+                    }
+                    if (z->bit_count >= 8) {
+                        z->output[z->output_position++] = (unsigned char)inflate_take(z, 8);
+                        z->stored_remaining--;
+                        if (inflate_overran(z)) {
+                            return INFLATE_CORRUPT;
+                        }
+                        continue;
+                    }
+                    if (z->position == z->input_size) {
+                        return z->input_final ? INFLATE_CORRUPT : INFLATE_NEED_INPUT;
+                    }
+                    size_t count = z->stored_remaining;
+                    count = count < z->input_size - z->position ? count : z->input_size - z->position;
+                    count = count < z->output_size - z->output_position ? count : z->output_size - z->output_position;
+                    memcpy(z->output + z->output_position, z->input + z->position, count);
+                    z->output_position += count;
+                    z->position += count;
+                    z->stored_remaining -= count;
+                }
+                z->state = z->final_block ? INFLATE_TRAILER : INFLATE_BLOCK_HEADER;
+                break;
+            case INFLATE_HUFFMAN:
+#if INFLATE_FAST_LOOP
+                if (!inflate_run_fast(z)) {
+                    return INFLATE_CORRUPT;
+                }
+                if (z->state != INFLATE_HUFFMAN) {
+                    break;
+                }
+#endif
+                while (true) {
+                    if (z->output_position > z->output_size - INFLATE_MAX_MATCH) {
+                        return INFLATE_OK;
+                    }
+                    if (inflate_overran(z)) {
+                        return INFLATE_CORRUPT;
+                    }
+                    // A whole symbol with its extra bits and distance is decoded
+                    // at once, so it is started only when all of it has arrived.
+                    if (!z->input_final && inflate_available_bits(z) < INFLATE_MAX_SYMBOL_BITS) {
+                        return INFLATE_NEED_INPUT;
+                    }
+
+                    int symbol = inflate_decode(z, &z->lengths);
+                    if (symbol < 256) {
+                        if (symbol < 0) {
+                            return INFLATE_CORRUPT;
+                        }
+                        z->output[z->output_position++] = (unsigned char)symbol;
+                        continue;
+                    }
+                    if (symbol == 256) {
+                        z->state = z->final_block ? INFLATE_TRAILER : INFLATE_BLOCK_HEADER;
+                        break;
+                    }
+
+                    symbol -= 257;
+                    if (symbol >= 29) {
+                        return INFLATE_CORRUPT;
+                    }
+                    size_t length = deflate_length_base[symbol] + inflate_take(z, deflate_length_extra[symbol]);
+                    int distance_symbol = inflate_decode(z, &z->distances);
+                    if (distance_symbol < 0 || distance_symbol >= 30) {
+                        return INFLATE_CORRUPT;
+                    }
+                    size_t distance = deflate_distance_base[distance_symbol] + inflate_take(z, deflate_distance_extra[distance_symbol]);
+                    if (distance > z->output_position) {
+                        return INFLATE_CORRUPT;
+                    }
+
+                    unsigned char *out = z->output + z->output_position;
+                    const unsigned char *from = out - distance;
+                    for (size_t i = 0; i < length; i++) {
+                        out[i] = from[i];
+                    }
+                    z->output_position += length;
+                }
+                if (inflate_overran(z)) {
+                    return INFLATE_CORRUPT;
+                }
+                break;
+            case INFLATE_DONE:
+                return INFLATE_FINISHED;
+        }
+    }
+}
+
+static inline unsigned char paeth_predictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return (unsigned char)a;
+    }
+    if (pb <= pc) {
+        return (unsigned char)b;
+    }
+
+    return (unsigned char)c;
+}
+
+#ifdef PNG_X86_SIMD
+// Sub, Avg and Paeth depend on the reconstructed pixel to the left, so like
+// libpng's filter_sse2_intrinsics these kernels work one 3- or 4-byte pixel
+// per iteration with all channels in a single register.
+__attribute__((target("sse2")))
+static inline __m128i png_load_pixel(const unsigned char *p, int bpp)
+{
+    int32_t value = 0;
+    if (bpp == 4) {
+        memcpy(&value, p, 4);
+    } else {
+        memcpy(&value, p, 3);
+    }
+    return _mm_cvtsi32_si128(value);
+}
+
+__attribute__((target("sse2")))
+static inline void png_store_pixel(unsigned char *p, __m128i v, int bpp)
+{
+    int32_t value = _mm_cvtsi128_si32(v);
+    if (bpp == 4) {
+        memcpy(p, &value, 4);
+    } else {
+        memcpy(p, &value, 3);
+    }
+}
+
+__attribute__((target("sse2")))
+void png_unfilter_sub_sse2(const unsigned char *in, unsigned char *out, size_t stride, int bpp)
+{
+    __m128i d = _mm_setzero_si128();
+    for (size_t i = 0; i < stride; i += bpp) {
+        d = _mm_add_epi8(d, png_load_pixel(in + i, bpp));
+        png_store_pixel(out + i, d, bpp);
+    }
+}
+
+__attribute__((target("sse2")))
+void png_unfilter_avg_sse2(const unsigned char *in, const unsigned char *previous, unsigned char *out, size_t stride, int bpp)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i d = _mm_setzero_si128();
+    for (size_t i = 0; i < stride; i += bpp) {
+        __m128i b = png_load_pixel(previous + i, bpp);
+        // _mm_avg_epu8 rounds up; PNG truncates.
+        __m128i average = _mm_sub_epi8(_mm_avg_epu8(d, b), _mm_and_si128(_mm_xor_si128(d, b), one));
+        d = _mm_add_epi8(png_load_pixel(in + i, bpp), average);
+        png_store_pixel(out + i, d, bpp);
+    }
+}
+
+__attribute__((target("ssse3")))
+void png_unfilter_paeth_ssse3(const unsigned char *in, const unsigned char *previous, unsigned char *out, size_t stride, int bpp)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i b = zero;
+    for (size_t i = 0; i < stride; i += bpp) {
+        __m128i c = b;
+        b = _mm_unpacklo_epi8(png_load_pixel(previous + i, bpp), zero);
+        // With p = a + b - c: p - a = b - c, p - b = a - c, p - c = both.
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+        pa = _mm_abs_epi16(pa);
+        pb = _mm_abs_epi16(pb);
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        // Ties favor a, then b, then c.
+        __m128i use_a = _mm_cmpeq_epi16(smallest, pa);
+        __m128i use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb));
+        __m128i predictor = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)),
+            _mm_andnot_si128(_mm_or_si128(use_a, use_b), c)
+        );
+        // Byte-wise addition wraps modulo 256 and leaves the high bytes zero.
+        a = _mm_add_epi8(_mm_unpacklo_epi8(png_load_pixel(in + i, bpp), zero), predictor);
+        png_store_pixel(out + i, _mm_packus_epi16(a, a), bpp);
+    }
+}
+#endif
+
+bool png_unfilter_row(int filter, const unsigned char *in, const unsigned char *previous, unsigned char *out, size_t stride, int bpp)
+{
+#ifdef PNG_X86_SIMD
+    if (bpp == 3 || bpp == 4) {
+        if (filter == 1 && __builtin_cpu_supports("sse2")) {
+            png_unfilter_sub_sse2(in, out, stride, bpp);
+            return true;
+        }
+        if (filter == 3 && __builtin_cpu_supports("sse2")) {
+            png_unfilter_avg_sse2(in, previous, out, stride, bpp);
+            return true;
+        }
+        if (filter == 4 && __builtin_cpu_supports("ssse3")) {
+            png_unfilter_paeth_ssse3(in, previous, out, stride, bpp);
+            return true;
+        }
+    }
+#endif
+    switch (filter) {
+        case 0:
+            memcpy(out, in, stride);
+            break;
+        case 1:
+            memcpy(out, in, bpp);
+            for (size_t i = bpp; i < stride; i++) {
+                out[i] = (unsigned char)(in[i] + out[i - bpp]);
+            }
+            break;
+        case 2:
+            for (size_t i = 0; i < stride; i++) {
+                out[i] = (unsigned char)(in[i] + previous[i]);
+            }
+            break;
+        case 3:
+            for (size_t i = 0; i < (size_t)bpp; i++) {
+                out[i] = (unsigned char)(in[i] + (previous[i] >> 1));
+            }
+            for (size_t i = bpp; i < stride; i++) {
+                out[i] = (unsigned char)(in[i] + ((out[i - bpp] + previous[i]) >> 1));
+            }
+            break;
+        case 4:
+            for (size_t i = 0; i < (size_t)bpp; i++) {
+                out[i] = (unsigned char)(in[i] + previous[i]);
+            }
+            for (size_t i = bpp; i < stride; i++) {
+                out[i] = (unsigned char)(in[i] + paeth_predictor(out[i - bpp], previous[i], previous[i - bpp]));
+            }
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+png_stream *png_stream_create(png_row_sink sink, void *sink_context)
+{
+    pthread_once(&crc32_table_once, crc32_table_init);
+
+    png_stream *stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        return NULL;
+    }
+    stream->state = PNG_STREAM_SIGNATURE;
+    stream->adler = 1;
+    stream->sink = sink;
+    stream->sink_context = sink_context;
+
+    return stream;
+}
+
+void png_stream_destroy(png_stream *stream)
+{
+    if (stream == NULL) {
+        return;
+    }
+
+    png_stream_release_buffers(stream);
+    free(stream);
+}
+
+void png_stream_release_buffers(png_stream *stream)
+{
+    slab_free(stream->window);
+    slab_free(stream->compressed);
+    slab_free(stream->row);
+    slab_free(stream->current);
+    slab_free(stream->previous);
+    stream->window = NULL;
+    stream->compressed = NULL;
+    stream->compressed_size = 0;
+    stream->compressed_capacity = 0;
+    stream->row = NULL;
+    stream->current = NULL;
+    stream->previous = NULL;
+}
+
+void png_stream_pass_through(png_stream *stream)
+{
+    // The rest of the upload is only buffered. The filter job decodes it,
+    // with stb_image for formats the streaming decoder does not cover.
+    png_stream_release_buffers(stream);
+    stream->state = PNG_STREAM_PASSTHROUGH;
+}
+
+bool png_stream_reject(png_stream *stream)
+{
+    png_stream_release_buffers(stream);
+    stream->state = PNG_STREAM_MALFORMED;
+
+    return false;
+}
+
+bool png_stream_read_header(png_stream *stream, const unsigned char *data, uint32_t length)
+{
+    if (length != 13) {
+        return false;
+    }
+
+    uint32_t width = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+    uint32_t height = (uint32_t)data[4] << 24 | (uint32_t)data[5] << 16 | (uint32_t)data[6] << 8 | data[7];
+    int depth = data[8];
+    int color_type = data[9];
+    if (width == 0 || height == 0 || width > MAX_IMAGE_DIMENSION || height > MAX_IMAGE_DIMENSION ||
+        data[10] != 0 || data[11] != 0 || data[12] > 1) {
+        return false;
+    }
+
+    static const int color_type_channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    if (color_type > 6 || (color_type != 3 && color_type_channels[color_type] == 0)) {
+        return false;
+    }
+
+    stream->width = (int)width;
+    stream->height = (int)height;
+    stream->header_seen = true;
+
+    if (depth != 8 || color_type == 3 || data[12] != 0) {
+        png_stream_pass_through(stream);
+        return true;
+    }
+
+    stream->channels = color_type_channels[color_type];
+    stream->stride = (size_t)width * stream->channels;
+    if ((size_t)width * height > INT_MAX / (size_t)stream->channels) {
+        return false;
+    }
+
+    // Without a sink the rows are only checked, never reconstructed.
+    if (stream->sink != NULL) {
+        stream->row = slab_alloc(stream->stride + 1);
+        stream->current = slab_alloc(stream->stride);
+        stream->previous = slab_alloc(stream->stride);
+        if (!stream->row || !stream->current || !stream->previous) {
+            png_stream_pass_through(stream);
+            return true;
+        }
+        memset(stream->previous, 0, stream->stride);
+    }
+    stream->window = slab_alloc(INFLATE_OUTPUT_SIZE);
+    if (!stream->window) {
+        png_stream_pass_through(stream);
+        return true;
+    }
+    inflate_init(&stream->inflater, stream->window, INFLATE_OUTPUT_SIZE);
+
+    return true;
+}
+
+bool png_stream_consume(png_stream *stream, const unsigned char *data, size_t size)
+{
+    stream->adler = adler32_update(stream->adler, data, size);
+
+    while (size > 0 && stream->rows_done < stream->height) {
+        size_t row_size = stream->stride + 1;
+        size_t count = row_size - stream->row_filled;
+        count = count < size ? count : size;
+        if (stream->sink != NULL) {
+            memcpy(stream->row + stream->row_filled, data, count);
+        } else if (stream->row_filled == 0 && data[0] > 4) {
+            return false;
+        }
+        stream->row_filled += count;
+        data += count;
+        size -= count;
+
+        if (stream->row_filled == row_size) {
+            if (stream->sink != NULL) {
+                if (!png_unfilter_row(stream->row[0], stream->row + 1, stream->previous, stream->current, stream->stride, stream->channels) ||
+                    !stream->sink(stream->sink_context, stream->current)) {
+                    return false;
+                }
+                unsigned char *previous = stream->previous;
+                stream->previous = stream->current;
+                stream->current = previous;
+            }
+            stream->rows_done++;
+            stream->row_filled = 0;
+        }
+    }
+
+    return true;
+}
+
+bool png_stream_inflate(png_stream *stream, bool input_final)
+{
+    inflater *z = &stream->inflater;
+
+    while (z->state != INFLATE_DONE) {
+        inflate_result result = inflate_run(z, stream->compressed, stream->compressed_size, input_final);
+        if (!png_stream_consume(stream, z->output + z->output_start, z->output_position - z->output_start)) {
+            return false;
+        }
+        if (result == INFLATE_CORRUPT) {
+            return false;
+        }
+        if (result == INFLATE_NEED_INPUT) {
+            break;
+        }
+    }
+
+    // Input the inflater has moved past is never read again.
+    if (z->position > INFLATE_WINDOW_SIZE && z->position * 2 > stream->compressed_size) {
+        memmove(stream->compressed, stream->compressed + z->position, stream->compressed_size - z->position);
+        stream->compressed_size -= z->position;
+        z->position = 0;
+    }
+
+    if (z->state == INFLATE_DONE && z->expected_adler != stream->adler) {
+        return false;
+    }
+
+    return true;
+}
+
+bool png_stream_append_compressed(png_stream *stream, const unsigned char *data, size_t size)
+{
+    if (size == 0) {
+        return true;
+    }
+
+    if (stream->compressed_size + size > stream->compressed_capacity) {
+        size_t capacity = stream->compressed_capacity > 0 ? stream->compressed_capacity : INFLATE_WINDOW_SIZE;
+        while (capacity < stream->compressed_size + size) {
+            capacity *= 2;
+        }
+        unsigned char *grown = slab_realloc(stream->compressed, capacity);
+        if (!grown) {
+            return false;
+        }
+        stream->compressed = grown;
+        stream->compressed_capacity = capacity;
+    }
+
+    memcpy(stream->compressed + stream->compressed_size, data, size);
+    stream->compressed_size += size;
+
+    return true;
+}
+
+bool png_stream_feed(png_stream *stream, const unsigned char *data, size_t size)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    while (stream->state != PNG_STREAM_PASSTHROUGH && stream->state != PNG_STREAM_MALFORMED) {
+        size_t available = size - stream->parsed;
+        switch (stream->state) {
+            case PNG_STREAM_SIGNATURE:
+                if (available < sizeof(signature)) {
+                    if (memcmp(data, signature, size) != 0) {
+                        png_stream_pass_through(stream);
+                    }
+                    return true;
+                }
+                if (memcmp(data, signature, sizeof(signature)) != 0) {
+                    png_stream_pass_through(stream);
+                    return true;
+                }
+                stream->parsed = sizeof(signature);
+                stream->state = PNG_STREAM_CHUNK_HEADER;
+                break;
+            case PNG_STREAM_CHUNK_HEADER: {
+                if (available < 8) {
+                    return true;
+                }
+                const unsigned char *header = data + stream->parsed;
+                stream->chunk_length = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+                memcpy(stream->chunk_type, header + 4, 4);
+                if (stream->chunk_length > INT32_MAX ||
+                    (!stream->header_seen && memcmp(stream->chunk_type, "IHDR", 4) != 0)) {
+                    return png_stream_reject(stream);
+                }
+                // Palettes, transparency and Apple's CgBI variant change how
+                // stb_image expands the pixels, so those images take its path.
+                if (memcmp(stream->chunk_type, "PLTE", 4) == 0 || memcmp(stream->chunk_type, "tRNS", 4) == 0 ||
+                    memcmp(stream->chunk_type, "CgBI", 4) == 0) {
+                    png_stream_pass_through(stream);
+                    return true;
+                }
+                stream->chunk_crc = crc32_update(0, header + 4, 4);
+                stream->chunk_received = 0;
+                stream->parsed += 8;
+                stream->state = PNG_STREAM_CHUNK_DATA;
+                break;
+            }
+            case PNG_STREAM_CHUNK_DATA: {
+                // Data is inflated a window at a time so that a large IDAT
+                // never has to be copied whole.
+                size_t count = stream->chunk_length - stream->chunk_received;
+                count = count < available ? count : available;
+                count = count < INFLATE_WINDOW_SIZE ? count : INFLATE_WINDOW_SIZE;
+                const unsigned char *chunk = data + stream->parsed;
+                stream->chunk_crc = crc32_update(stream->chunk_crc, chunk, count);
+                stream->chunk_received += count;
+                stream->parsed += count;
+
+                if (memcmp(stream->chunk_type, "IDAT", 4) == 0 && stream->inflater.state != INFLATE_DONE) {
+                    if (!png_stream_append_compressed(stream, chunk, count)) {
+                        png_stream_pass_through(stream);
+                        return true;
+                    }
+                    if (!png_stream_inflate(stream, false)) {
+                        return png_stream_reject(stream);
+                    }
+                    // Checking stops after the start of the image data; the
+                    // filter job decodes the upload in full anyway.
+                    stream->compressed_checked += count;
+                    if (stream->sink == NULL && stream->compressed_checked >= INGEST_CHECK_SIZE) {
+                        png_stream_pass_through(stream);
+                        return true;
+                    }
+                }
+                if (stream->chunk_received < stream->chunk_length) {
+                    if (stream->parsed < size) {
+                        break;
+                    }
+                    return true;
+                }
+                stream->state = PNG_STREAM_CHUNK_CRC;
+                break;
+            }
+            case PNG_STREAM_CHUNK_CRC: {
+                if (available < 4) {
+                    return true;
+                }
+                const unsigned char *crc = data + stream->parsed;
+                uint32_t expected = (uint32_t)crc[0] << 24 | (uint32_t)crc[1] << 16 | (uint32_t)crc[2] << 8 | crc[3];
+                if (expected != stream->chunk_crc) {
+                    return png_stream_reject(stream);
+                }
+                const unsigned char *chunk = crc - stream->chunk_length;
+                stream->parsed += 4;
+                stream->state = PNG_STREAM_CHUNK_HEADER;
+
+                if (memcmp(stream->chunk_type, "IHDR", 4) == 0) {
+                    if (stream->header_seen || !png_stream_read_header(stream, chunk, stream->chunk_length)) {
+                        return png_stream_reject(stream);
+                    }
+                } else if (memcmp(stream->chunk_type, "IEND", 4) == 0) {
+                    if (!png_stream_inflate(stream, true) || stream->inflater.state != INFLATE_DONE ||
+                        stream->rows_done < stream->height) {
+                        return png_stream_reject(stream);
+                    }
+                    png_stream_release_buffers(stream);
+                    stream->state = PNG_STREAM_FINISHED;
+                } else if (!(stream->chunk_type[0] & 0x20) && memcmp(stream->chunk_type, "IDAT", 4) != 0) {
+                    png_stream_pass_through(stream);
+                }
+                break;
+            }
+            case PNG_STREAM_FINISHED:
+            case PNG_STREAM_PASSTHROUGH:
+            case PNG_STREAM_MALFORMED:
+                return stream->state != PNG_STREAM_MALFORMED;
+        }
+    }
+
+    return stream->state != PNG_STREAM_MALFORMED;
+}
+
+void deflate_tables_init(void)
+{
+    for (int symbol = 0; symbol < 288; symbol++) {
+        int code, length;
+        if (symbol < 144) {
+            code = 0x30 + symbol;
+            length = 8;
+        } else if (symbol < 256) {
+            code = 0x190 + symbol - 144;
+            length = 9;
+        } else if (symbol < 280) {
+            code = symbol - 256;
+            length = 7;
+        } else {
+            code = 0xc0 + symbol - 280;
+            length = 8;
+        }
+        deflate_fixed_codes[symbol] = (uint16_t)bit_reverse(code, length);
+        deflate_fixed_lengths[symbol] = (uint8_t)length;
+    }
+    for (int symbol = 0; symbol < 30; symbol++) {
+        deflate_fixed_distance_codes[symbol] = (uint16_t)bit_reverse(symbol, 5);
+    }
+}
+
+
+static inline int deflate_length_symbol(size_t length)
+{
+    unsigned int value = (unsigned int)length - 3;
+    if (value < 8) {
+        return (int)value;
+    }
+    if (value == 255) {
+        return 28;
+    }
+    int top = 31 - __builtin_clz(value);
+
+    return 4 * (top - 1) + (int)((value >> (top - 2)) & 3);
+}
+
+static inline int deflate_distance_symbol(size_t distance)
+{
+    unsigned int value = (unsigned int)distance - 1;
+    if (value < 4) {
+        return (int)value;
+    }
+    int top = 31 - __builtin_clz(value);
+
+    return 2 * top + (int)((value >> (top - 1)) & 1);
+}
+
+static inline uint32_t deflate_hash(const unsigned char *data)
+{
+    uint32_t value = (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16;
+
+    return (value * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline int32_t deflate_insert(deflater *z, size_t position)
+{
+    uint32_t hash = deflate_hash(z->window + position);
+    int32_t candidate = z->head[hash];
+    z->prev[position & (DEFLATE_WINDOW_SIZE - 1)] = candidate;
+    z->head[hash] = (int32_t)position;
+
+    return candidate;
+}
+
+static inline void deflate_put_bits(deflater *z, uint32_t value, int count)
+{
+    z->bits |= (uint64_t)value << z->bit_count;
+    z->bit_count += count;
+    if (z->bit_count >= 32) {
+        unsigned char *out = z->output + z->output_size;
+        out[0] = (unsigned char)z->bits;
+        out[1] = (unsigned char)(z->bits >> 8);
+        out[2] = (unsigned char)(z->bits >> 16);
+        out[3] = (unsigned char)(z->bits >> 24);
+        z->output_size += 4;
+        z->bits >>= 32;
+        z->bit_count -= 32;
+    }
+}
+
+static inline void deflate_put_bytes(deflater *z)
+{
+    while (z->bit_count >= 8) {
+        z->output[z->output_size++] = (unsigned char)z->bits;
+        z->bits >>= 8;
+        z->bit_count -= 8;
+    }
+}
+
+static inline void deflate_record_literal(deflater *z, unsigned char literal)
+{
+    z->symbol_values[z->symbol_count] = literal;
+    z->symbol_distances[z->symbol_count] = 0;
+    z->symbol_count++;
+    z->fixed_bits += deflate_fixed_lengths[literal];
+}
+
+static inline void deflate_record_match(deflater *z, size_t length, size_t distance)
+{
+    int length_symbol = deflate_length_symbol(length);
+    int distance_symbol = deflate_distance_symbol(distance);
+    z->symbol_values[z->symbol_count] = (uint16_t)length;
+    z->symbol_distances[z->symbol_count] = (uint16_t)distance;
+    z->symbol_count++;
+    z->fixed_bits += deflate_fixed_lengths[257 + length_symbol] + deflate_length_extra[length_symbol] +
+                     5 + deflate_distance_extra[distance_symbol];
+}
+
+int deflate_init(deflater *z, const compression_preset *preset, void (*emit)(void *context, const unsigned char *data, size_t size), void *emit_context)
+{
+    pthread_once(&crc32_table_once, crc32_table_init);
+    pthread_once(&deflate_tables_once, deflate_tables_init);
+
+    memset(z, 0, sizeof(*z));
+    z->window = slab_alloc(2 * DEFLATE_WINDOW_SIZE);
+    z->head = slab_alloc(((size_t)1 << DEFLATE_HASH_BITS) * sizeof(*z->head));
+    z->prev = slab_alloc(DEFLATE_WINDOW_SIZE * sizeof(*z->prev));
+    z->symbol_values = slab_alloc(DEFLATE_BLOCK_SYMBOLS * sizeof(*z->symbol_values));
+    z->symbol_distances = slab_alloc(DEFLATE_BLOCK_SYMBOLS * sizeof(*z->symbol_distances));
+    z->output = slab_alloc(DEFLATE_OUTPUT_SIZE);
+    if (!z->window || !z->head || !z->prev || !z->symbol_values || !z->symbol_distances || !z->output) {
+        deflate_destroy(z);
+        return EXIT_FAILURE;
+    }
+    z->preset = preset;
+    z->emit = emit;
+    z->emit_context = emit_context;
+    deflate_reset(z);
+
+    return EXIT_SUCCESS;
+}
+
+void deflate_destroy(deflater *z)
+{
+    slab_free(z->window);
+    slab_free(z->head);
+    slab_free(z->prev);
+    slab_free(z->symbol_values);
+    slab_free(z->symbol_distances);
+    slab_free(z->output);
+    z->window = NULL;
+    z->head = NULL;
+    z->prev = NULL;
+    z->symbol_values = NULL;
+    z->symbol_distances = NULL;
+    z->output = NULL;
+}
+
+void deflate_reset(deflater *z)
+{
+    memset(z->head, 0xff, ((size_t)1 << DEFLATE_HASH_BITS) * sizeof(*z->head));
+    memset(z->prev, 0xff, DEFLATE_WINDOW_SIZE * sizeof(*z->prev));
+    z->window_size = 0;
+    z->position = 0;
+    z->block_start = 0;
+    z->symbol_count = 0;
+    z->fixed_bits = 0;
+    z->match_length = 0;
+    z->match_distance = 0;
+    z->match_available = false;
+    z->bits = 0;
+    z->bit_count = 0;
+    z->output_size = 0;
+    z->adler = 1;
+}
+
+void deflate_prime(deflater *z, const unsigned char *dictionary, size_t size)
+{
+    // The data preceding a segment is only matched against, never emitted.
+    size = size < DEFLATE_WINDOW_SIZE ? size : DEFLATE_WINDOW_SIZE;
+    memcpy(z->window, dictionary, size);
+    z->window_size = size;
+    z->position = size;
+    z->block_start = size;
+    for (size_t position = 0; position + DEFLATE_MIN_MATCH <= size; position++) {
+        deflate_insert(z, position);
+    }
+}
+
+size_t deflate_longest_match(deflater *z, int32_t candidate, size_t position, size_t best, size_t *distance)
+{
+    size_t max_length = z->window_size - position;
+    max_length = max_length < DEFLATE_MAX_MATCH ? max_length : DEFLATE_MAX_MATCH;
+    if (best < DEFLATE_MIN_MATCH - 1) {
+        best = DEFLATE_MIN_MATCH - 1;
+    }
+    if (best >= max_length) {
+        return 0;
+    }
+
+    size_t limit = position > DEFLATE_MAX_DISTANCE ? position - DEFLATE_MAX_DISTANCE : 0;
+    const unsigned char *scan = z->window + position;
+    size_t found = 0;
+    int chain = z->preset->max_chain;
+    while (candidate >= 0 && (size_t)candidate >= limit && (size_t)candidate < position && chain-- > 0) {
+        const unsigned char *match = z->window + candidate;
+        if (match[best] == scan[best] && match[0] == scan[0] && match[1] == scan[1]) {
+            size_t length = 0;
+            while (length + 8 <= max_length) {
+                uint64_t a, b;
+                memcpy(&a, match + length, 8);
+                memcpy(&b, scan + length, 8);
+                if (a != b) {
+                    length += __builtin_ctzll(a ^ b) / 8;
+                    break;
+                }
+                length += 8;
+            }
+            if (length + 8 > max_length) {
+                while (length < max_length && match[length] == scan[length]) {
+                    length++;
+                }
+            }
+            if (length > best) {
+                best = length;
+                found = length;
+                *distance = position - (size_t)candidate;
+                if (length >= z->preset->nice_match || length == max_length) {
+                    break;
+                }
+            }
+        }
+        candidate = z->prev[candidate & (DEFLATE_WINDOW_SIZE - 1)];
+    }
+
+    return found;
+}
+
+void deflate_compress(deflater *z, bool flush)
+{
+    // Matches are chosen lazily: one found at a position is only taken if
+    // the next position does not start a longer one.
+    size_t end = flush ? z->window_size : z->window_size > DEFLATE_MIN_LOOKAHEAD ? z->window_size - DEFLATE_MIN_LOOKAHEAD : 0;
+    while (z->position < end) {
+        size_t position = z->position;
+        size_t previous_length = z->match_length;
+        size_t previous_distance = z->match_distance;
+        size_t length = 0;
+        size_t distance = 0;
+
+        if (z->window_size - position >= DEFLATE_MIN_MATCH) {
+            int32_t candidate = deflate_insert(z, position);
+            if (candidate >= 0 && previous_length < z->preset->lazy_match) {
+                length = deflate_longest_match(z, candidate, position, previous_length, &distance);
+                if (length == DEFLATE_MIN_MATCH && distance > DEFLATE_FAR_MATCH_DISTANCE) {
+                    length = 0;
+                }
+            }
+        }
+
+        if (previous_length >= DEFLATE_MIN_MATCH && length == 0) {
+            deflate_record_match(z, previous_length, previous_distance);
+            size_t match_end = position - 1 + previous_length;
+            for (size_t next = position + 1; next < match_end; next++) {
+                if (z->window_size - next >= DEFLATE_MIN_MATCH) {
+                    deflate_insert(z, next);
+                }
+            }
+            z->position = match_end;
+            z->match_available = false;
+            z->match_length = 0;
+        } else {
+            if (z->match_available) {
+                deflate_record_literal(z, z->window[position - 1]);
+            }
+            z->match_available = true;
+            z->match_length = length;
+            z->match_distance = distance;
+            z->position = position + 1;
+        }
+
+        if (z->symbol_count == DEFLATE_BLOCK_SYMBOLS) {
+            deflate_flush_block(z, false);
+        }
+    }
+}
+
+void deflate_flush_block(deflater *z, bool final)
+{
+    // Each block is coded with the fixed tables or stored as is, whichever is
+    // shorter, so incompressible rows never grow by more than a few bytes.
+    size_t covered = z->position - (z->match_available ? 1 : 0);
+    size_t raw_size = covered - z->block_start;
+    size_t pieces = raw_size / DEFLATE_MAX_STORED_BLOCK + 1;
+    size_t stored_bits = pieces * (3 + 7 + 32) + 8 * raw_size;
+    size_t fixed_bits = 3 + z->fixed_bits + 7;
+
+    if (stored_bits < fixed_bits) {
+        const unsigned char *raw = z->window + z->block_start;
+        for (size_t piece = 0; piece < pieces; piece++) {
+            size_t size = raw_size < DEFLATE_MAX_STORED_BLOCK ? raw_size : DEFLATE_MAX_STORED_BLOCK;
+            raw_size -= size;
+            deflate_put_bits(z, final && raw_size == 0, 1);
+            deflate_put_bits(z, 0, 2);
+            deflate_put_bits(z, 0, (8 - z->bit_count % 8) % 8);
+            deflate_put_bytes(z);
+            unsigned char *out = z->output + z->output_size;
+            out[0] = (unsigned char)size;
+            out[1] = (unsigned char)(size >> 8);
+            out[2] = (unsigned char)~size;
+            out[3] = (unsigned char)(~size >> 8);
+            memcpy(out + 4, raw, size);
+            z->output_size += 4 + size;
+            raw += size;
+        }
+    } else {
+        deflate_put_bits(z, final, 1);
+        deflate_put_bits(z, 1, 2);
+        for (size_t i = 0; i < z->symbol_count; i++) {
+            size_t distance = z->symbol_distances[i];
+            size_t value = z->symbol_values[i];
+            if (distance == 0) {
+                deflate_put_bits(z, deflate_fixed_codes[value], deflate_fixed_lengths[value]);
+                continue;
+            }
+            int length_symbol = deflate_length_symbol(value);
+            deflate_put_bits(z, deflate_fixed_codes[257 + length_symbol], deflate_fixed_lengths[257 + length_symbol]);
+            deflate_put_bits(z, (uint32_t)(value - deflate_length_base[length_symbol]), deflate_length_extra[length_symbol]);
+            int distance_symbol = deflate_distance_symbol(distance);
+            deflate_put_bits(z, deflate_fixed_distance_codes[distance_symbol], 5);
+            deflate_put_bits(z, (uint32_t)(distance - deflate_distance_base[distance_symbol]), deflate_distance_extra[distance_symbol]);
+        }
+        deflate_put_bits(z, deflate_fixed_codes[256], deflate_fixed_lengths[256]);
+    }
+
+    z->symbol_count = 0;
+    z->fixed_bits = 0;
+    z->block_start = covered;
+
+    deflate_put_bytes(z);
+    if (z->output_size > 0) {
+        z->emit(z->emit_context, z->output, z->output_size);
+        z->output_size = 0;
+    }
+}
+
+void deflate_slide(deflater *z)
+{
+    // The block is finished first so that a stored block can still reach
+    // all of its bytes.
+    deflate_flush_block(z, false);
+
+    memmove(z->window, z->window + DEFLATE_WINDOW_SIZE, z->window_size - DEFLATE_WINDOW_SIZE);
+    z->window_size -= DEFLATE_WINDOW_SIZE;
+    z->position -= DEFLATE_WINDOW_SIZE;
+    z->block_start -= DEFLATE_WINDOW_SIZE;
+    for (size_t i = 0; i < ((size_t)1 << DEFLATE_HASH_BITS); i++) {
+        z->head[i] = z->head[i] >= DEFLATE_WINDOW_SIZE ? z->head[i] - DEFLATE_WINDOW_SIZE : -1;
+    }
+    for (size_t i = 0; i < DEFLATE_WINDOW_SIZE; i++) {
+        z->prev[i] = z->prev[i] >= DEFLATE_WINDOW_SIZE ? z->prev[i] - DEFLATE_WINDOW_SIZE : -1;
+    }
+}
+
+void deflate_write(deflater *z, const unsigned char *data, size_t size)
+{
+    z->adler = adler32_update(z->adler, data, size);
+
+    while (size > 0) {
+        if (z->window_size == 2 * DEFLATE_WINDOW_SIZE) {
+            deflate_slide(z);
+        }
+        size_t count = 2 * DEFLATE_WINDOW_SIZE - z->window_size;
+        count = count < size ? count : size;
+        memcpy(z->window + z->window_size, data, count);
+        z->window_size += count;
+        data += count;
+        size -= count;
+        deflate_compress(z, false);
+    }
+}
+
+void deflate_flush(deflater *z, bool final)
+{
+    deflate_compress(z, true);
+    if (z->match_available) {
+        deflate_record_literal(z, z->window[z->position - 1]);
+        z->match_available = false;
+    }
+    deflate_flush_block(z, final);
+
+    // Segments that others follow end on a byte boundary with an empty
+    // stored block, the same marker zlib writes for a sync flush.
+    if (!final) {
+        deflate_put_bits(z, 0, 3);
+    }
+    deflate_put_bits(z, 0, (8 - z->bit_count % 8) % 8);
+    deflate_put_bytes(z);
+    if (!final) {
+        static const unsigned char marker[4] = { 0x00, 0x00, 0xff, 0xff };
+        memcpy(z->output + z->output_size, marker, sizeof(marker));
+        z->output_size += sizeof(marker);
+    }
+    if (z->output_size > 0) {
+        z->emit(z->emit_context, z->output, z->output_size);
+        z->output_size = 0;
+    }
+}
+
+void deflate_segment_emit(void *context, const unsigned char *data, size_t size)
+{
+    deflate_segment *segment = (deflate_segment *)context;
+    if (segment->failed) {
+        return;
+    }
+
+    if (segment->output_size + size > segment->output_capacity) {
+        size_t capacity = segment->output_capacity > 0 ? segment->output_capacity : DEFLATE_OUTPUT_SIZE;
+        while (capacity < segment->output_size + size) {
+            capacity *= 2;
+        }
+        unsigned char *grown = slab_realloc(segment->output, capacity);
+        if (!grown) {
+            segment->failed = true;
+            return;
+        }
+        segment->output = grown;
+        segment->output_capacity = capacity;
+    }
+    memcpy(segment->output + segment->output_size, data, size);
+    segment->output_size += size;
+}
+
+int deflate_segment_run(void *argument)
+{
+    deflate_segment *segment = (deflate_segment *)argument;
+
+    deflate_reset(&segment->deflater);
+    segment->output_size = 0;
+    segment->failed = false;
+    deflate_prime(&segment->deflater, segment->dictionary, segment->dictionary_size);
+    deflate_write(&segment->deflater, segment->data, segment->size);
+    deflate_flush(&segment->deflater, false);
+
+    return segment->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int png_filter_row(const unsigned char *row, const unsigned char *previous, unsigned char *candidates, size_t stride, int bpp, int filter)
+{
+    if (filter >= 0) {
+        unsigned char *out = candidates + filter * (stride + 1);
+        out[0] = (unsigned char)filter;
+        for (size_t i = 0; i < stride; i++) {
+            int x = row[i];
+            int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+            int b = previous[i];
+            int c = i >= (size_t)bpp ? previous[i - bpp] : 0;
+            switch (filter) {
+                case 0:
+                    out[i + 1] = (unsigned char)x;
+                    break;
+                case 1:
+                    out[i + 1] = (unsigned char)(x - a);
+                    break;
+                case 2:
+                    out[i + 1] = (unsigned char)(x - b);
+                    break;
+                case 3:
+                    out[i + 1] = (unsigned char)(x - ((a + b) >> 1));
+                    break;
+                default:
+                    out[i + 1] = (unsigned char)(x - paeth_predictor(a, b, c));
+                    break;
+            }
+        }
+        return filter;
+    }
+
+    // Every filter is tried and the one with the smallest sum of absolute
+    // differences is kept, the same estimate stb_image_write uses.
+    unsigned char *none = candidates;
+    unsigned char *sub = none + stride + 1;
+    unsigned char *up = sub + stride + 1;
+    unsigned char *average = up + stride + 1;
+    unsigned char *paeth = average + stride + 1;
+    unsigned int sums[5] = { 0, 0, 0, 0, 0 };
+
+    for (size_t i = 0; i < stride; i++) {
+        int x = row[i];
+        int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+        int b = previous[i];
+        int c = i >= (size_t)bpp ? previous[i - bpp] : 0;
+        none[i + 1] = (unsigned char)x;
+        sub[i + 1] = (unsigned char)(x - a);
+        up[i + 1] = (unsigned char)(x - b);
+        average[i + 1] = (unsigned char)(x - ((a + b) >> 1));
+        paeth[i + 1] = (unsigned char)(x - paeth_predictor(a, b, c));
+        sums[0] += abs((signed char)none[i + 1]);
+        sums[1] += abs((signed char)sub[i + 1]);
+        sums[2] += abs((signed char)up[i + 1]);
+        sums[3] += abs((signed char)average[i + 1]);
+        sums[4] += abs((signed char)paeth[i + 1]);
+    }
+
+    int best = 0;
+    for (int candidate = 0; candidate < 5; candidate++) {
+        candidates[candidate * (stride + 1)] = (unsigned char)candidate;
+        if (sums[candidate] < sums[best]) {
+            best = candidate;
+        }
+    }
+
+    return best;
+}
+
+void png_writer_chunk(png_writer *writer, const char *type, const unsigned char *data, size_t size)
+{
+    unsigned char header[8] = {
+        (unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size,
+        (unsigned char)type[0], (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3]
+    };
+    uint32_t crc = crc32_update(crc32_update(0, header + 4, 4), data, size);
+    unsigned char trailer[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+
+    writer->write(writer->context, header, sizeof(header));
+    if (size > 0) {
+        writer->write(writer->context, (void *)data, (int)size);
+    }
+    writer->write(writer->context, trailer, sizeof(trailer));
+}
+
+void png_writer_emit(void *context, const unsigned char *data, size_t size)
+{
+    png_writer *writer = (png_writer *)context;
+
+    while (size > 0) {
+        size_t count = PNG_IDAT_SIZE - writer->chunk_size;
+        count = count < size ? count : size;
+        memcpy(writer->chunk + writer->chunk_size, data, count);
+        writer->chunk_size += count;
+        data += count;
+        size -= count;
+        if (writer->chunk_size == PNG_IDAT_SIZE) {
+            png_writer_flush(writer);
+        }
+    }
+}
+
+void png_writer_flush(png_writer *writer)
+{
+    if (writer->chunk_size > 0) {
+        png_writer_chunk(writer, "IDAT", writer->chunk, writer->chunk_size);
+        writer->chunk_size = 0;
+    }
+}
+
+int png_writer_init(png_writer *writer, int w, int h, int channels, const compression_preset *preset, stbi_write_func *write, void *context)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    static const unsigned char color_types[5] = { 0, 0, 4, 2, 6 };
+
+    memset(writer, 0, sizeof(*writer));
+    writer->write = write;
+    writer->context = context;
+    writer->preset = preset;
+    writer->channels = channels;
+    writer->stride = (size_t)w * channels;
+    writer->previous = slab_alloc(writer->stride);
+    writer->candidates = slab_alloc(5 * (writer->stride + 1));
+    writer->chunk = slab_alloc(PNG_IDAT_SIZE);
+    if (!writer->previous || !writer->candidates || !writer->chunk ||
+        deflate_init(&writer->deflater, preset, png_writer_emit, writer) != EXIT_SUCCESS) {
+        png_writer_destroy(writer);
+        return EXIT_FAILURE;
+    }
+    memset(writer->previous, 0, writer->stride);
+
+    unsigned char header[13] = {
+        (unsigned char)(w >> 24), (unsigned char)(w >> 16), (unsigned char)(w >> 8), (unsigned char)w,
+        (unsigned char)(h >> 24), (unsigned char)(h >> 16), (unsigned char)(h >> 8), (unsigned char)h,
+        8, color_types[channels], 0, 0, 0
+    };
+    write(context, (void *)signature, sizeof(signature));
+    png_writer_chunk(writer, "IHDR", header, sizeof(header));
+
+    // A 32 KB window at the default compression level.
+    static const unsigned char zlib_header[2] = { 0x78, 0x9c };
+    png_writer_emit(writer, zlib_header, sizeof(zlib_header));
+    writer->adler = 1;
+
+    return EXIT_SUCCESS;
+}
+
+void png_writer_row(png_writer *writer, const unsigned char *row)
+{
+    int filter = png_filter_row(row, writer->previous, writer->candidates, writer->stride, writer->channels, writer->preset->filter);
+    deflate_write(&writer->deflater, writer->candidates + filter * (writer->stride + 1), writer->stride + 1);
+    memcpy(writer->previous, row, writer->stride);
+}
+
+int png_writer_rows(png_writer *writer, const unsigned char *rows, int count, band_pool *pool)
+{
+    // Filtered rows are deflated in independent segments on the band pool,
+    // pigz style: each one is primed with the 32 KB before it and ends on a
+    // byte boundary, so the outputs simply follow each other in the stream.
+    size_t row_size = writer->stride + 1;
+    size_t size = (size_t)count * row_size;
+    if (writer->encoded_capacity < DEFLATE_WINDOW_SIZE + size) {
+        unsigned char *grown = slab_realloc(writer->encoded, DEFLATE_WINDOW_SIZE + size);
+        if (!grown) {
+            return EXIT_FAILURE;
+        }
+        writer->encoded = grown;
+        writer->encoded_capacity = DEFLATE_WINDOW_SIZE + size;
+    }
+
+    unsigned char *data = writer->encoded + writer->dictionary_size;
+    for (int y = 0; y < count; y++) {
+        const unsigned char *row = rows + (size_t)y * writer->stride;
+        const unsigned char *previous = y > 0 ? row - writer->stride : writer->previous;
+        int filter = png_filter_row(row, previous, writer->candidates, writer->stride, writer->channels, writer->preset->filter);
+        memcpy(data + (size_t)y * row_size, writer->candidates + filter * row_size, row_size);
+    }
+    memcpy(writer->previous, rows + (size_t)(count - 1) * writer->stride, writer->stride);
+
+    int workers = pool != NULL && pool->worker_count > 0 ? pool->worker_count : 1;
+    int segment_count = (int)(size / PNG_SEGMENT_SIZE);
+    segment_count = segment_count < 1 ? 1 : segment_count > workers ? workers : segment_count;
+    if (writer->segments == NULL) {
+        writer->segments = calloc(workers, sizeof(*writer->segments));
+        if (!writer->segments) {
+            return EXIT_FAILURE;
+        }
+    }
+    while (writer->segment_count < segment_count) {
+        deflate_segment *segment = &writer->segments[writer->segment_count];
+        if (deflate_init(&segment->deflater, writer->preset, deflate_segment_emit, segment) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        writer->segment_count++;
+    }
+    writer->segmented = true;
+
+    size_t piece = size / segment_count;
+    for (int i = 0; i < segment_count; i++) {
+        deflate_segment *segment = &writer->segments[i];
+        segment->data = data + (size_t)i * piece;
+        segment->size = i == segment_count - 1 ? size - (size_t)i * piece : piece;
+        size_t before = (size_t)(segment->data - writer->encoded);
+        segment->dictionary_size = before < DEFLATE_WINDOW_SIZE ? before : DEFLATE_WINDOW_SIZE;
+        segment->dictionary = segment->data - segment->dictionary_size;
+    }
+
+    int result;
+    if (segment_count == 1) {
+        result = deflate_segment_run(&writer->segments[0]);
+    } else {
+        band_task *tasks = calloc(segment_count, sizeof(*tasks));
+        if (!tasks) {
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < segment_count; i++) {
+            tasks[i].run = deflate_segment_run;
+            tasks[i].argument = &writer->segments[i];
+        }
+        result = band_pool_run(pool, tasks, segment_count);
+        free(tasks);
+    }
+    if (result != EXIT_SUCCESS) {
+        return result;
+    }
+
+    for (int i = 0; i < segment_count; i++) {
+        deflate_segment *segment = &writer->segments[i];
+        png_writer_emit(writer, segment->output, segment->output_size);
+        writer->adler = adler32_combine(writer->adler, segment->deflater.adler, segment->size);
+    }
+
+    size_t total = writer->dictionary_size + size;
+    size_t keep = total < DEFLATE_WINDOW_SIZE ? total : DEFLATE_WINDOW_SIZE;
+    memmove(writer->encoded, writer->encoded + total - keep, keep);
+    writer->dictionary_size = keep;
+
+    return EXIT_SUCCESS;
+}
+
+void png_writer_finish(png_writer *writer)
+{
+    if (writer->segmented) {
+        // Every segment ended with a sync flush; an empty fixed block closes
+        // the stream.
+        static const unsigned char final_block[2] = { 0x03, 0x00 };
+        png_writer_emit(writer, final_block, sizeof(final_block));
+    } else {
+        deflate_flush(&writer->deflater, true);
+        writer->adler = writer->deflater.adler;
+    }
+
+    unsigned char trailer[4] = {
+        (unsigned char)(writer->adler >> 24), (unsigned char)(writer->adler >> 16), (unsigned char)(writer->adler >> 8), (unsigned char)writer->adler
+    };
+    png_writer_emit(writer, trailer, sizeof(trailer));
+    png_writer_flush(writer);
+    png_writer_chunk(writer, "IEND", NULL, 0);
+}
+
+void png_writer_destroy(png_writer *writer)
+{
+    deflate_destroy(&writer->deflater);
+    for (int i = 0; i < writer->segment_count; i++) {
+        deflate_destroy(&writer->segments[i].deflater);
+        slab_free(writer->segments[i].output);
+    }
+    free(writer->segments);
+    slab_free(writer->encoded);
+    slab_free(writer->previous);
+    slab_free(writer->candidates);
+    slab_free(writer->chunk);
+    writer->segments = NULL;
+    writer->segment_count = 0;
+    writer->encoded = NULL;
+    writer->previous = NULL;
+    writer->candidates = NULL;
+    writer->chunk = NULL;
+}
+
+int image_pipeline_init(image_pipeline *pipeline, int w, int h, int channels, int window, const compression_preset *preset, band_pool *pool, stbi_write_func *write, void *context)
+{
+    memset(pipeline, 0, sizeof(*pipeline));
+    if (w <= 0 || h <= 0 || channels <= 0 || channels > 4) {
+        return EXIT_FAILURE;
+    }
+
+    // Rows are filtered in batches that keep every band worker busy, plus
+    // the radius of rows above and below that the batch reads.
+    pipeline->width = w;
+    pipeline->height = h;
+    pipeline->channels = channels;
+    pipeline->stride = (size_t)w * channels;
+    pipeline->radius = window / 2;
+    pipeline->batch_rows = MIN_BAND_ROWS > 4 * window ? MIN_BAND_ROWS : 4 * window;
+    if (pool != NULL && pool->worker_count > 0 && (size_t)w * (size_t)h >= PARALLEL_FILTER_MIN_PIXELS) {
+        pipeline->pool = pool;
+        pipeline->batch_rows *= pool->worker_count;
+    }
+    if (pipeline->batch_rows > h) {
+        pipeline->batch_rows = h;
+    }
+    pipeline->ring_rows = pipeline->batch_rows + 2 * pipeline->radius;
+
+    pipeline->ring = slab_alloc((size_t)pipeline->ring_rows * pipeline->stride);
+    pipeline->rows = slab_alloc((size_t)pipeline->ring_rows * sizeof(*pipeline->rows));
+    pipeline->filtered = slab_alloc((size_t)pipeline->batch_rows * pipeline->stride);
+    if (!pipeline->ring || !pipeline->rows || !pipeline->filtered ||
+        png_writer_init(&pipeline->writer, w, h, channels, preset, write, context) != EXIT_SUCCESS) {
+        slab_free(pipeline->ring);
+        slab_free(pipeline->rows);
+        slab_free(pipeline->filtered);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void image_pipeline_destroy(image_pipeline *pipeline)
+{
+    png_writer_destroy(&pipeline->writer);
+    slab_free(pipeline->ring);
+    slab_free(pipeline->rows);
+    slab_free(pipeline->filtered);
+}
+
+int image_pipeline_filter(image_pipeline *pipeline, int count)
+{
+    int first = pipeline->rows_filtered - pipeline->radius;
+    for (int i = 0; i < count + 2 * pipeline->radius; i++) {
+        int y = clamp_int(first + i, 0, pipeline->height - 1);
+        pipeline->rows[i] = pipeline->ring + (size_t)(y % pipeline->ring_rows) * pipeline->stride;
+    }
+
+    int result;
+    if (pipeline->pool != NULL) {
+        result = band_pool_filter(pipeline->pool, pipeline->rows, pipeline->filtered, pipeline->width, count, pipeline->channels, pipeline->radius);
+    } else {
+        result = median_filter_rows(pipeline->rows, pipeline->filtered, pipeline->width, pipeline->channels, pipeline->radius, count);
+    }
+    if (result != EXIT_SUCCESS) {
+        return result;
+    }
+
+    if (pipeline->pool != NULL) {
+        result = png_writer_rows(&pipeline->writer, pipeline->filtered, count, pipeline->pool);
+        if (result != EXIT_SUCCESS) {
+            return result;
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            png_writer_row(&pipeline->writer, pipeline->filtered + (size_t)i * pipeline->stride);
+        }
+    }
+    pipeline->rows_filtered += count;
+
+    return EXIT_SUCCESS;
+}
+
+bool image_pipeline_push(void *context, const unsigned char *row)
+{
+    image_pipeline *pipeline = (image_pipeline *)context;
+    if (pipeline->rows_received == pipeline->height) {
+        return false;
+    }
+
+    unsigned char *slot = pipeline->ring + (size_t)(pipeline->rows_received % pipeline->ring_rows) * pipeline->stride;
+    memcpy(slot, row, pipeline->stride);
+    pipeline->rows_received++;
+
+    // A row can be filtered once the radius of rows below it has arrived;
+    // the last row of the image stands in for the ones past the edge.
+    bool last = pipeline->rows_received == pipeline->height;
+    int ready = (last ? pipeline->height : pipeline->rows_received - pipeline->radius) - pipeline->rows_filtered;
+    while (ready >= pipeline->batch_rows || (last && ready > 0)) {
+        int count = ready < pipeline->batch_rows ? ready : pipeline->batch_rows;
+        if (image_pipeline_filter(pipeline, count) != EXIT_SUCCESS) {
+            return false;
+        }
+        ready -= count;
+    }
+
+    return true;
+}
+
+int image_pipeline_finish(image_pipeline *pipeline)
+{
+    if (pipeline->rows_filtered != pipeline->height) {
+        return EXIT_FAILURE;
+    }
+    png_writer_finish(&pipeline->writer);
+
+    return EXIT_SUCCESS;
+}
+
+int process_image_rows(image_job *job, band_pool *pool, buffer_context *output)
+{
+    image_pipeline pipeline;
+    png_stream *stream = png_stream_create(image_pipeline_push, &pipeline);
+    if (!stream) {
+        return EXIT_FAILURE;
+    }
+
+    // IHDR leads the file, so the pipeline is sized before any row is decoded.
+    size_t header_size = job->original_size < PNG_HEADER_SIZE ? job->original_size : PNG_HEADER_SIZE;
+    if (!png_stream_feed(stream, job->original_image, header_size) || stream->state != PNG_STREAM_CHUNK_HEADER ||
+        image_pipeline_init(&pipeline, stream->width, stream->height, stream->channels, job->window, &compression_presets[job->compression], pool, write_image_callback, output) != EXIT_SUCCESS) {
+        png_stream_destroy(stream);
+        return EXIT_FAILURE;
+    }
+    // The output rarely exceeds the bound, so it is allocated once; the
+    // pages past what is written are never touched.
+    buffer_context_reserve(output, png_output_bound(stream->width, stream->height, stream->channels));
+
+    int result = EXIT_FAILURE;
+    if (png_stream_feed(stream, job->original_image, job->original_size) && stream->state == PNG_STREAM_FINISHED) {
+        result = image_pipeline_finish(&pipeline);
+    }
+    image_pipeline_destroy(&pipeline);
+    png_stream_destroy(stream);
+
+    return result;
+}
+
+int process_image_frame(image_job *job, band_pool *pool, buffer_context *output)
+{
+    int w, h, channels;
+    unsigned char *img = stbi_load_from_memory(job->original_image, job->original_size, &w, &h, &channels, 0);
+    if (!img) {
+        return EXIT_FAILURE;
+    }
+
+    image_pipeline pipeline;
+    if (image_pipeline_init(&pipeline, w, h, channels, job->window, &compression_presets[job->compression], pool, write_image_callback, output) != EXIT_SUCCESS) {
+        stbi_image_free(img);
+        return EXIT_FAILURE;
+    }
+    buffer_context_reserve(output, png_output_bound(w, h, channels));
+
+    size_t stride = (size_t)w * channels;
+    int result = EXIT_SUCCESS;
+    for (int y = 0; y < h && result == EXIT_SUCCESS; y++) {
+        if (!image_pipeline_push(&pipeline, img + (size_t)y * stride)) {
+            result = EXIT_FAILURE;
+        }
+    }
+    if (result == EXIT_SUCCESS) {
+        result = image_pipeline_finish(&pipeline);
+    }
+    image_pipeline_destroy(&pipeline);
+    stbi_image_free(img);
+
+    return result;
+}
+
+size_t job_memory_estimate(int w, int h, int channels)
+{
+    // The most a job holds at once: a whole decoded frame when stb_image
+    // decodes it, and the encoded output reserved at its upper bound.
+    return (size_t)w * h * channels + png_output_bound(w, h, channels);
+}
+
+void process_image(image_job *job, band_pool *pool)
+{
+    if (!job->original_image || job->original_size == 0) {
+        return;
+    }
+
+    buffer_context output;
+    buffer_context_init(&output, NULL, 0);
+
+    // Images the row decoder does not cover are decoded whole by stb_image
+    // and then fed through the same pipeline, reusing the output buffer.
+    int result = process_image_rows(job, pool, &output);
+    if (result != EXIT_SUCCESS && !output.failed) {
+        output.size = 0;
+        result = process_image_frame(job, pool, &output);
+    }
+    if (output.failed) {
+        fprintf(stderr, "Failed to allocate the processed image\n");
+    }
+    if (result != EXIT_SUCCESS) {
+        buffer_context_free(&output);
+        return;
+    }
+
+    size_t out_size = 0;
+    unsigned char *out_buffer = buffer_context_detach(&output, &out_size);
+    if (!out_buffer) {
+        return;
+    }
+
+    image_result *processed = malloc(sizeof(*processed));
+    if (!processed) {
+        fprintf(stderr, "Failed to allocate the processed image\n");
+        slab_free(out_buffer);
+        return;
+    }
+    atomic_init(&processed->references, 1);
+    processed->data = out_buffer;
+    processed->size = out_size;
+    atomic_store_explicit(&job->result, processed, memory_order_release);
+}
+
+image_job *image_job_finish(server_context *context, image_job *job)
+{
+    // Duplicates that arrived in the meantime share the result and age
+    // alongside the job itself. A duplicate to process in place of a failed
+    // job is returned.
+    image_job *retry;
+    image_job *aliases = result_cache_finish(&context->results, job, &retry);
+
+    // The upload is not needed once filtered, unless later duplicates are
+    // compared against it.
+    if (!job->cached) {
+        slab_free(job->original_image);
+        job->original_image = NULL;
+    }
+
+    job_retention_add(&context->retention, job);
+    for (image_job *alias = aliases; alias != NULL; alias = alias->next_alias) {
+        job_retention_add(&context->retention, alias);
+    }
+
+    return retry;
+}
+
+int queue_response(http_connection *connection, const char *response_data, size_t response_size)
+{
+    if (response_size >= sizeof(connection->response.header)) {
+        fprintf(stderr, "The response header does not fit into the response buffer\n");
+        return EXIT_FAILURE;
+    }
+
+    memcpy(connection->response.header, response_data, response_size);
+    connection->response.header_size = response_size;
+    connection->response.header_sent = 0;
+    connection->state = CONNECTION_SENDING_RESPONSE;
+
+    return 0;
+}
+
+int finish_response_header(http_connection *connection)
+{
+    http_response *response = &connection->response;
+
+    // HTTP/1.1 connections persist by default, HTTP/1.0 ones only when asked to.
+    const char *connection_header = NULL;
+    if (!connection->keep_alive) {
+        connection_header = "Connection: close\r\n";
+    } else if (connection->request.minor_version == 0) {
+        connection_header = "Connection: keep-alive\r\n";
+    }
+
+    if (response->cached_file != NULL) {
+        if (connection_header == NULL) {
+            response->header_data = response->cached_file->header;
+            return 0;
+        }
+        if (response->cached_file->header_size > sizeof(response->header)) {
+            fprintf(stderr, "The response header does not fit into the response buffer\n");
+            return EXIT_FAILURE;
+        }
+        memcpy(response->header, response->cached_file->header, response->cached_file->header_size);
+    }
+    response->header_data = response->header;
+
+    // Every header ends with an empty line; the extra fields go in front of it.
+    size_t header_size = response->header_size - 2;
+    size_t space = sizeof(response->header) - header_size;
+    int written = 0;
+    if (memmem(response->header, header_size, "\r\nContent-Length:", 17) == NULL) {
+        written = snprintf(
+            response->header + header_size, space, "Content-Length: %zu\r\n",
+            response->body_size + response->file_remaining
+        );
+        if (written < 0 || (size_t)written >= space) {
+            fprintf(stderr, "The response header does not fit into the response buffer\n");
+            return EXIT_FAILURE;
+        }
+        header_size += written;
+        space -= written;
+    }
+
+    written = snprintf(response->header + header_size, space, "%s\r\n", connection_header != NULL ? connection_header : "");
+    if (written < 0 || (size_t)written >= space) {
+        fprintf(stderr, "The response header does not fit into the response buffer\n");
+        return EXIT_FAILURE;
+    }
+    response->header_size = header_size + written;
+
+    return 0;
+}
+
+io_status send_response(http_connection *connection)
+{
+    http_response *response = &connection->response;
+
+    const char *header = response->header_data;
+
+    // The header and the body go out through one gathered write. MSG_MORE
+    // holds them back when a file follows, like a corked socket would.
+    while (response->header_sent < response->header_size || response->body_sent < response->body_size) {
+        struct iovec parts[2];
+        int part_count = 0;
+        if (response->header_sent < response->header_size) {
+            parts[part_count].iov_base = (void *)(header + response->header_sent);
+            parts[part_count].iov_len = response->header_size - response->header_sent;
+            part_count++;
+        }
+        if (response->body_sent < response->body_size) {
+            parts[part_count].iov_base = (void *)(response->body + response->body_sent);
+            parts[part_count].iov_len = response->body_size - response->body_sent;
+            part_count++;
+        }
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = parts;
+        message.msg_iovlen = part_count;
+
+        ssize_t sent = sendmsg(connection->socket, &message, MSG_NOSIGNAL | (response->file_remaining > 0 ? MSG_MORE : 0));
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WANT_WRITE;
+            }
+            return IO_ERROR;
+        }
+
+        size_t header_part = response->header_size - response->header_sent;
+        if ((size_t)sent < header_part) {
+            response->header_sent += sent;
+        } else {
+            response->header_sent = response->header_size;
+            response->body_sent += sent - header_part;
+        }
+    }
+
+    while (response->file_handle != -1) {
+        if (response->file_remaining == 0) {
+            close(response->file_handle);
+            response->file_handle = -1;
+            break;
+        }
+
+        ssize_t sent = sendfile(connection->socket, response->file_handle, &response->file_offset, response->file_remaining);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WANT_WRITE;
+            }
+            perror("Failed to send the requested file");
+            return IO_ERROR;
+        }
+        if (sent == 0) {
+            fprintf(stderr, "The requested file was truncated while being sent\n");
+            return IO_ERROR;
+        }
+
+        response->file_remaining -= sent;
+    }
+
+    return IO_DONE;
+}
+
+int handle_post_images(http_connection *connection, server_context *context)
+{
+    size_t content_length_size;
+    const char *content_length_start = connection_header(connection, "Content-Length", &content_length_size);
+    if (!content_length_start) {
+        char response_data[] = "HTTP/1.1 411 Length Required\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+    char *endptr;
+    errno = 0;
+    size_t content_length = strtoul(content_length_start, &endptr, 10);
+    if (errno != 0 || endptr == content_length_start || endptr != content_length_start + content_length_size ||
+        content_length == 0) {
+        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    if (content_length > MAX_IMAGE_SIZE) {
+        char response_data[] = "HTTP/1.1 413 Payload Too Large\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    char window_value[16];
+    int window_found = parse_query_parameter(connection->query, "window", window_value, sizeof(window_value));
+    if (window_found != 0) {
+        errno = 0;
+        long window = strtol(window_value, &endptr, 10);
+        if (window_found == -1 || errno != 0 || endptr == window_value || *endptr != '\0' ||
+            window < 1 || window > MAX_MEDIAN_WINDOW || window % 2 == 0) {
+            char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+            return queue_response(connection, response_data, sizeof(response_data) - 1);
+        }
+        connection->window = (int)window;
+    }
+
+    char compression_value[16];
+    int compression_found = parse_query_parameter(connection->query, "png", compression_value, sizeof(compression_value));
+    if (compression_found != 0) {
+        int level = 0;
+        while (level < COMPRESSION_PRESETS && (compression_found == -1 || strcmp(compression_value, compression_presets[level].name) != 0)) {
+            level++;
+        }
+        if (level == COMPRESSION_PRESETS) {
+            char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+            return queue_response(connection, response_data, sizeof(response_data) - 1);
+        }
+        connection->compression = (compression_level)level;
+    }
+
+    // Refused before the body is read when the queue is already full; the
+    // connection is closed after. The place is only taken once it arrives.
+    if (!image_task_queue_accepting(&context->tasks)) {
+        char response_data[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " TO_STRING(RETRY_AFTER_SECONDS) "\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    size_t header_size = connection->request.header_size;
+    const char *body_start = connection->request_data + header_size;
+    size_t initial_body_size = connection->request_size - header_size;
+
+    unsigned char *image_buffer = NULL;
+    image_buffer = slab_alloc(content_length);
+    if (!image_buffer) {
+        char response_data[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    if (initial_body_size > content_length) {
+        initial_body_size = content_length;
+    }
+
+    memcpy(image_buffer, body_start, initial_body_size);
+    connection->request_consumed = header_size + initial_body_size;
+
+    connection->body = image_buffer;
+    connection->body_size = initial_body_size;
+    connection->content_length = content_length;
+    connection->state = CONNECTION_RECEIVING_BODY;
+
+    if (context->streaming_ingest) {
+        // Only the signature, the header and the first few KB of image data
+        // are checked here; the filter job decodes the upload row by row.
+        // Without a decoder it is simply buffered.
+        connection->ingest = png_stream_create(NULL, NULL);
+        if (connection->ingest != NULL && !png_stream_feed(connection->ingest, image_buffer, initial_body_size)) {
+            return 0;
+        }
+    }
+
+    // Clients that ask first hold the body back until the interim response
+    // arrives. It is sent at once; the socket has nothing else queued.
+    size_t expect_size;
+    const char *expect = connection_header(connection, "Expect", &expect_size);
+    if (expect != NULL && header_contains_token(expect, expect_size, "100-continue") &&
+        connection->request.minor_version >= 1 && initial_body_size < content_length) {
+        static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        ssize_t sent = send(connection->socket, continue_response, sizeof(continue_response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent != (ssize_t)(sizeof(continue_response) - 1)) {
+            fprintf(stderr, "Failed to send the interim response\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    return 0;
+}
+
+int complete_post_images(http_connection *connection, server_context *context)
+{
+    png_stream *ingest = connection->ingest;
+    if (ingest != NULL && ingest->state != PNG_STREAM_FINISHED && ingest->state != PNG_STREAM_PASSTHROUGH) {
+        if (connection->body_size < connection->content_length) {
+            connection->keep_alive = false;
+        }
+        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    // The header alone tells how much memory decoding will take. The
+    // upload itself is held until the job is done, so it counts too.
+    size_t upload = connection->body_size;
+    size_t memory = upload;
+    int w, h, channels;
+    if (upload <= INT_MAX && stbi_info_from_memory(connection->body, (int)upload, &w, &h, &channels)) {
+        memory += job_memory_estimate(w, h, channels);
+    }
+    if (memory > context->tasks.memory_limit) {
+        char response_data[] = "HTTP/1.1 413 Payload Too Large\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    // The place in the queue is taken before anything else, so that however
+    // many uploads finish at once, only as many as fit are accepted.
+    if (!image_task_queue_reserve(&context->tasks, upload)) {
+        char response_data[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " TO_STRING(RETRY_AFTER_SECONDS) "\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    image_job *job = malloc(sizeof(*job));
+    image_task *task = malloc(sizeof(*task));
+    if (!job || !task) {
+        free(job);
+        free(task);
+        image_task_queue_cancel(&context->tasks, upload);
+        char response_data[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    uuid_generate(job->id);
+    job->original_image = connection->body;
+    job->original_size = connection->body_size;
+    job->window = connection->window;
+    job->compression = connection->compression;
+    uint64_t settings = (uint64_t)job->window << 8 | job->compression;
+    job->content_hash = xxh64(job->original_image, job->original_size, settings);
+    job->cached = false;
+    job->aliases = NULL;
+    job->next_alias = NULL;
+    job->finished = false;
+    atomic_init(&job->result, NULL);
+    atomic_init(&job->expired, false);
+    atomic_init(&job->accessed, 0);
+    job->listed_at = 0;
+    job->finished_at = 0;
+    job->expired_at = 0;
+    job->charge = 0;
+    memset(job->links, 0, sizeof(job->links));
+    job->next_retired = NULL;
+    job->purged = false;
+
+    if (job_store_insert(&context->jobs, job) != EXIT_SUCCESS) {
+        free(job);
+        free(task);
+        image_task_queue_cancel(&context->tasks, upload);
+        char response_data[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+    connection->body = NULL;
+
+    // A repeated upload gets its own ID but shares the first job's result,
+    // finished or not, instead of being filtered again.
+    // A duplicate handed a finished result by the claim is retained now;
+    // one still waiting is retained when its origin finishes.
+    unsigned char *original_image = job->original_image;
+    bool shared;
+    if (result_cache_claim(&context->results, job, &shared) != NULL) {
+        slab_free(original_image);
+        free(task);
+        image_task_queue_cancel(&context->tasks, upload);
+        if (shared) {
+            job_retention_add(&context->retention, job);
+        }
+    } else {
+        task->job = job;
+        task->memory = memory;
+        task->upload = upload;
+        image_task_queue_push(&context->tasks, task);
+    }
+
+    char uuid_str[37];
+    uuid_unparse_lower(job->id, uuid_str);
+
+    int written = snprintf(connection->response.header, sizeof(connection->response.header), "HTTP/1.1 202 Accepted\r\nLocation: /images/%s/\r\n\r\n", uuid_str);
+    if (written < 0 || (size_t)written >= sizeof(connection->response.header)) {
+        char response_data[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+    connection->response.header_size = written;
+    connection->state = CONNECTION_SENDING_RESPONSE;
+
+    return 0;
+}
+
+int handle_get_image(http_connection *connection, server_context *context)
+{
+    const char *path = connection->path;
+
+    char uuid_str[37] = {0};
+    if (sscanf(path, "/images/%36[0-9a-f-]", uuid_str) != 1 || 
+        strlen(uuid_str) != 36) {
+        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    if (uuid_str[8] != '-' || uuid_str[13] != '-' || uuid_str[18] != '-' || uuid_str[23] != '-') {
+        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    uuid_t id;
+    if (uuid_parse(uuid_str, id) != 0) {
+        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    // The result is referenced before leaving, so it outlives the job's
+    // eviction for as long as the response is being sent.
+    unsigned epoch = job_store_enter(&context->jobs);
+    image_job *job = job_store_find(&context->jobs, id);
+    bool expired = job != NULL && atomic_load(&job->expired);
+    image_result *result = NULL;
+    if (job != NULL && !expired) {
+        result = atomic_load_explicit(&job->result, memory_order_acquire);
+        if (result != NULL) {
+            atomic_fetch_add_explicit(&result->references, 1, memory_order_relaxed);
+            atomic_store_explicit(&job->accessed, monotonic_seconds(), memory_order_relaxed);
+        }
+    }
+    job_store_leave(&context->jobs, epoch);
+
+    if (!job) {
+        char response_data[] = "HTTP/1.1 404 Not Found\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+    if (expired) {
+        char response_data[] = "HTTP/1.1 410 Gone\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+    if (!result) {
+        char response_data[] = "HTTP/1.1 202 Accepted\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    connection->response.result = result;
+    char response_header[] = "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n\r\n";
+    if (queue_response(connection, response_header, sizeof(response_header) - 1) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    connection->response.body = result->data;
+    connection->response.body_size = result->size;
+
+    return 0;
+}
+
+int handle_get_stats(http_connection *connection, server_context *context)
+{
+    image_task_queue *tasks = &context->tasks;
+    pthread_mutex_lock(&tasks->lock);
+    size_t queued_jobs = tasks->length;
+    size_t reserved = tasks->memory_reserved;
+    size_t refused = tasks->refused;
+    pthread_mutex_unlock(&tasks->lock);
+
+    job_retention *retention = &context->retention;
+    pthread_mutex_lock(&retention->lock);
+    size_t retained = retention->retained;
+    size_t retained_bytes = retention->retained_bytes;
+    size_t tombstones = retention->tombstones;
+    pthread_mutex_unlock(&retention->lock);
+
+    long anon_huge_kb = 0;
+    FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+    if (smaps != NULL) {
+        char line[256];
+        while (fgets(line, sizeof(line), smaps) != NULL) {
+            if (sscanf(line, "AnonHugePages: %ld kB", &anon_huge_kb) == 1) {
+                break;
+            }
+        }
+        fclose(smaps);
+    }
+
+    size_t hugetlb = atomic_load_explicit(&slab_stats.hugetlb_mappings, memory_order_relaxed);
+    size_t transparent = atomic_load_explicit(&slab_stats.transparent_mappings, memory_order_relaxed);
+    size_t normal = atomic_load_explicit(&slab_stats.normal_mappings, memory_order_relaxed);
+    size_t hugetlb_allocations = atomic_load_explicit(&slab_stats.hugetlb_allocations, memory_order_relaxed);
+    size_t transparent_allocations = atomic_load_explicit(&slab_stats.transparent_allocations, memory_order_relaxed);
+    size_t normal_allocations = atomic_load_explicit(&slab_stats.normal_allocations, memory_order_relaxed);
+    size_t allocations = hugetlb_allocations + transparent_allocations + normal_allocations;
+
+    http_response *response = &connection->response;
+    int written = snprintf(
+        response->text, sizeof(response->text),
+        "slab_cache_hits %zu\n"
+        "slab_cache_misses %zu\n"
+        "slab_cached_bytes %zu\n"
+        "slab_cache_limit %zu\n"
+        "hugetlb_mappings %zu\n"
+        "transparent_hugepage_mappings %zu\n"
+        "normal_page_mappings %zu\n"
+        "hugetlb_allocations %zu\n"
+        "transparent_hugepage_allocations %zu\n"
+        "normal_page_allocations %zu\n"
+        "hugepage_hit_rate %.3f\n"
+        "anon_huge_pages_kb %ld\n"
+        "queued_jobs %zu\n"
+        "job_memory_reserved %zu\n"
+        "job_memory_limit %zu\n"
+        "refused_uploads %zu\n"
+        "retained_results %zu\n"
+        "retained_result_bytes %zu\n"
+        "result_byte_limit %zu\n"
+        "result_ttl_seconds %ld\n"
+        "expired_results %zu\n",
+        atomic_load_explicit(&slab_stats.cache_hits, memory_order_relaxed),
+        atomic_load_explicit(&slab_stats.cache_misses, memory_order_relaxed),
+        atomic_load_explicit(&slab_stats.cached_bytes, memory_order_relaxed), (size_t)SLAB_CACHE_MAX_BYTES,
+        hugetlb, transparent, normal,
+        hugetlb_allocations, transparent_allocations, normal_allocations,
+        allocations > 0 ? (double)(hugetlb_allocations + transparent_allocations) / allocations : 0.0,
+        anon_huge_kb,
+        queued_jobs, reserved, tasks->memory_limit, refused,
+        retained, retained_bytes, retention->byte_limit, (long)retention->ttl, tombstones
+    );
+    if (written < 0 || (size_t)written >= sizeof(response->text)) {
+        char response_data[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    char response_header[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\nCache-Control: no-store\r\n\r\n";
+    if (queue_response(connection, response_header, sizeof(response_header) - 1) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    response->body = (const unsigned char *)response->text;
+    response->body_size = (size_t)written;
+
+    return 0;
+}
+
+int handle_get_static_file(http_connection *connection, server_context *context)
+{
+    const char *path = connection->path;
+    const char *server_dir_path = context->server_dir_path;
+    size_t server_dir_path_len = context->server_dir_path_len;
+
+    if (strstr(path, "..") != NULL) {
+        char response_data[] = "HTTP/1.1 403 Forbidden\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    if (path[0] != '/') {
+        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    static_file *cached_file = static_cache_find(&context->statics, strcmp(path, "/") == 0 ? "/index.html" : path);
+    if (cached_file != NULL) {
+        http_response *response = &connection->response;
+        response->cached_file = cached_file;
+        response->header_size = cached_file->header_size;
+        response->header_sent = 0;
+        response->body = cached_file->data;
+        response->body_size = cached_file->size;
+        response->body_sent = 0;
+        connection->state = CONNECTION_SENDING_RESPONSE;
+        return 0;
+    }
+
+    char file_name[NAME_MAX + 1] = {0};
+    size_t path_len = strlen(path);
+
+    if (path_len > NAME_MAX) {
+        char response_data[] = "HTTP/1.1 414 URI Too Long\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    strncpy(file_name, path, NAME_MAX);
+    file_name[NAME_MAX] = '\0';
+
+    if (strcmp(file_name, "/") == 0) {
+        strncat(file_name, "index.html", NAME_MAX - strlen(file_name));
+    }
+
+    const char* file_path_part = file_name;
+    if (file_path_part[0] == '/') {
+        file_path_part++;
+    }
+
+    char file_path[PATH_MAX + 1] = {0};
+    int path_len_required = snprintf(file_path, PATH_MAX, "%s/%s", server_dir_path, file_path_part);
+
+    if (path_len_required < 0 || path_len_required >= PATH_MAX) {
+        char response_data[] = "HTTP/1.1 414 URI Too Long\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    char resolved_path[PATH_MAX + 1] = {0};
+    if (realpath(file_path, resolved_path) == NULL) {
+        char response_data[] = "HTTP/1.1 404 Not Found\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+    if (strncmp(resolved_path, server_dir_path, server_dir_path_len) != 0) {
+        char response_data[] = "HTTP/1.1 403 Forbidden\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    int file_to_serve_handle = open(resolved_path, O_RDONLY);
+    if (file_to_serve_handle == -1) {
+        char response_data[] = "HTTP/1.1 404 Not Found\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    struct stat file_status;
+    if (fstat(file_to_serve_handle, &file_status) == -1 || !S_ISREG(file_status.st_mode)) {
+        close(file_to_serve_handle);
+        char response_data[] = "HTTP/1.1 404 Not Found\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    http_response *response = &connection->response;
+    int header_size = format_static_file_header(response->header, sizeof(response->header), resolved_path, &file_status);
+    if (header_size < 0) {
+        close(file_to_serve_handle);
+        return EXIT_FAILURE;
+    }
+
+    response->header_size = header_size;
+    response->header_sent = 0;
+    response->file_handle = file_to_serve_handle;
+    response->file_offset = 0;
+    response->file_remaining = file_status.st_size;
+    connection->state = CONNECTION_SENDING_RESPONSE;
+
+    return 0;
+}
+
+int send_not_implemented(http_connection *connection)
+{
+    char response_data[] = "HTTP/1.1 501 Not Implemented\r\n\r\n";
+    return queue_response(connection, response_data, sizeof(response_data) - 1);
+}
+
+int set_client_socket_options(int client_socket)
+{
+    if (client_socket < 0) {
+        return EXIT_FAILURE;
+    }
+
+    const int tcp_nodelay = 1;
+    if (setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &tcp_nodelay, sizeof(tcp_nodelay)) == -1) {
+        perror("Failed to set TCP_NODELAY");
         return EXIT_FAILURE;
     }
-#endif
 
     struct timeval timeout;
-    timeout.tv_sec = 30;
+    timeout.tv_sec = CLIENT_TIMEOUT_SECONDS;
     timeout.tv_usec = 0;
+    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
+        perror("Failed to set client receive timeout");
+        return EXIT_FAILURE;
+    }
 
-    if (setsockopt(*server_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
-        perror("Failed to set receive timeout");
-        close(*server_socket);
-        *server_socket = -1;
+    if (setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
+        perror("Failed to set client send timeout");
         return EXIT_FAILURE;
     }
 
-    if (setsockopt(*server_socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
-        perror("Failed to set send timeout");
-        close(*server_socket);
-        *server_socket = -1;
+    return EXIT_SUCCESS;
+}
+
+int connection_queue_init(connection_queue *queue, size_t capacity)
+{
+    memset(queue, 0, sizeof(*queue));
+
+    queue->sockets = calloc(capacity, sizeof(int));
+    if (!queue->sockets) {
+        perror("Failed to allocate the connection queue");
         return EXIT_FAILURE;
     }
+    queue->capacity = capacity;
 
-    const int nodelay = 1;
-    if (setsockopt(*server_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1) {
-        perror("Failed to set TCP_NODELAY on server socket");
-        close(*server_socket);
-        *server_socket = -1;
+    if (pthread_mutex_init(&queue->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the connection queue lock\n");
+        free(queue->sockets);
+        queue->sockets = NULL;
+        return EXIT_FAILURE;
+    }
+    if (pthread_cond_init(&queue->not_empty, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the connection queue condition\n");
+        pthread_mutex_destroy(&queue->lock);
+        free(queue->sockets);
+        queue->sockets = NULL;
+        return EXIT_FAILURE;
+    }
+    if (pthread_cond_init(&queue->not_full, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the connection queue condition\n");
+        pthread_cond_destroy(&queue->not_empty);
+        pthread_mutex_destroy(&queue->lock);
+        free(queue->sockets);
+        queue->sockets = NULL;
         return EXIT_FAILURE;
     }
 
-    struct sockaddr_in server_address;
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(SERVER_PORT);
+    return EXIT_SUCCESS;
+}
 
-    if (bind(*server_socket, (struct sockaddr *) &server_address, sizeof(server_address)) == -1) {
-        perror("Failed to bind to 0.0.0.0:" TO_STRING(SERVER_PORT));
-        close(*server_socket);
-        *server_socket = -1;
-        return EXIT_FAILURE;
+void connection_queue_destroy(connection_queue *queue)
+{
+    if (queue->sockets == NULL) {
+        return;
     }
 
-    if (listen(*server_socket, MAX_QUEUED_CONNECTIONS) == -1) {
-        perror("Failed to start listening for connections");
-        close(*server_socket);
-        *server_socket = -1;
+    while (queue->count > 0) {
+        cleanup_connection(queue->sockets[queue->head]);
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->sockets);
+    queue->sockets = NULL;
+}
+
+int connection_queue_push(connection_queue *queue, int request_socket)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->lock);
         return EXIT_FAILURE;
     }
 
-    puts("The server is listening on 0.0.0.0:" TO_STRING(SERVER_PORT));
+    queue->sockets[(queue->head + queue->count) % queue->capacity] = request_socket;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
 
     return EXIT_SUCCESS;
 }
 
-int receive_request(int request_socket, char *request_data, size_t max_size)
+int connection_queue_pop(connection_queue *queue)
 {
-    ssize_t bytes_received = recv(request_socket, request_data, max_size - 1, 0);
-    if (bytes_received == -1) {
-        perror("Failed to receive the request data");
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
         return -1;
     }
 
-    if (bytes_received >= 0) {
-        request_data[bytes_received] = '\0';
-    }
+    int request_socket = queue->sockets[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
 
-    return bytes_received;
+    return request_socket;
 }
 
-void parse_request(const char *request_data, char *method, char *path)
+bool connection_queue_waiting(connection_queue *queue)
 {
-    method[0] = '\0';
-    path[0] = '\0';
+    pthread_mutex_lock(&queue->lock);
+    bool waiting = queue->count > 0;
+    pthread_mutex_unlock(&queue->lock);
 
-    if (sscanf(request_data, "%9s %"TO_STRING(PATH_MAX)"s", method, path) < 2) {
-        method[0] = '\0';
-        path[0] = '\0';
-        return;
-    }
+    return waiting;
+}
 
-    method[9] = '\0';
-    path[PATH_MAX] = '\0';
+void connection_queue_close(connection_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
 }
 
-void cleanup_connection(int request_socket)
+int dispatch_request(http_connection *connection, server_context *context)
 {
-    if (shutdown(request_socket, SHUT_WR) == -1) {
-        if (errno != ENOTCONN) {
-            perror("Warning: Failed to shutdown write side of socket");
-        }
-    } else {
-        char leftovers[1024];
-        ssize_t bytes_read;
-        struct timeval timeout;
-        timeout.tv_sec = 2;
-        timeout.tv_usec = 0;
-        setsockopt(request_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
-        while ((bytes_read = recv(request_socket, leftovers, sizeof(leftovers), 0)) > 0) {}
-        if (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ETIMEDOUT) {
-            perror("Warning: Failed to drain the socket");
+    const http_request *request = &connection->request;
+
+    if (request->status != HTTP_PARSE_DONE) {
+        // Without a complete header block there is no telling where the next
+        // request would start, so the connection ends after this response.
+        connection->request_consumed = connection->request_size;
+        connection->keep_alive = false;
+        if (request->status == HTTP_PARSE_TOO_LARGE) {
+            char response_data[] = "HTTP/1.1 431 Request Header Fields Too Large\r\n\r\n";
+            return queue_response(connection, response_data, sizeof(response_data) - 1);
         }
-        if (shutdown(request_socket, SHUT_RD) == -1) {
-            if (errno != ENOTCONN) {
-                perror("Warning: Failed to shutdown read side of socket");
-            }
+        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return queue_response(connection, response_data, sizeof(response_data) - 1);
+    }
+
+    connection->request_consumed = request->header_size;
+    connection->method = connection->request_data + request->method.offset;
+    connection->path = connection->request_data + request->path.offset;
+    connection->query = connection->request_data + request->query.offset;
+
+    size_t value_size;
+    const char *value = connection_header(connection, "Connection", &value_size);
+    if (request->minor_version >= 1) {
+        if (value != NULL && header_contains_token(value, value_size, "close")) {
+            connection->keep_alive = false;
         }
+    } else if (value == NULL || !header_contains_token(value, value_size, "keep-alive")) {
+        connection->keep_alive = false;
+    }
+    if (connection->requests_served + 1 >= MAX_KEEP_ALIVE_REQUESTS) {
+        connection->keep_alive = false;
     }
 
-    if (close(request_socket) == -1) {
-        perror("Warning: Failed to close the socket");
+    int result = route_request(connection, context);
+
+    // A body that no handler read would be parsed as the next request.
+    value = connection_header(connection, "Content-Length", &value_size);
+    bool has_body = connection_header(connection, "Transfer-Encoding", &value_size) != NULL ||
+                    (value != NULL && strcmp(value, "0") != 0);
+    if (has_body && connection->state != CONNECTION_RECEIVING_BODY) {
+        connection->keep_alive = false;
     }
+
+    return result;
 }
 
-void cleanup_resources(int file_handle, int request_socket, int server_socket, image_job_entry *job_table)
+int route_request(http_connection *connection, server_context *context)
 {
-    if (file_handle != -1) {
-        close(file_handle);
+    const char *method = connection->method;
+    const char *path = connection->path;
+    if (strcmp(method, "POST") == 0 && strcmp(path, "/images") == 0) {
+        return handle_post_images(connection, context);
+    } else if (strcmp(method, "GET") == 0 && strncmp(path, "/images/", 8) == 0) {
+        return handle_get_image(connection, context);
+    } else if (strcmp(method, "GET") == 0 && strcmp(path, "/stats") == 0) {
+        return handle_get_stats(connection, context);
+    } else if (strcmp(method, "GET") == 0) {
+        return handle_get_static_file(connection, context);
     }
 
-    if (request_socket != -1) {
-        cleanup_connection(request_socket);
-    }
+    return send_not_implemented(connection);
+}
 
-    if (server_socket != -1) {
-        close(server_socket);
-    }
+void connection_init(http_connection *connection, int request_socket)
+{
+    connection->socket = request_socket;
+    connection->request_data[0] = '\0';
+    connection->request_size = 0;
+    connection->requests_served = 0;
+    connection->idle = false;
+    connection->last_activity = 0;
+    connection->prev = NULL;
+    connection->next = NULL;
 
-    if (job_table != NULL) {
-        for (int i = 0; i < shlenu(job_table); i++) {
-            if (job_table[i].key != NULL) {
-                free(job_table[i].key);
-                job_table[i].key = NULL;
-            }
-            if (job_table[i].value.original_image != NULL) {
-                free(job_table[i].value.original_image);
-                job_table[i].value.original_image = NULL;
-            }
-            if (job_table[i].value.processed_image != NULL) {
-                free(job_table[i].value.processed_image);
-                job_table[i].value.processed_image = NULL;
-            }
-        }
-        shfree(job_table);
-    }
+    connection_reset_request(connection);
 }
 
-void apply_median_filter(unsigned char *img, unsigned char *filtered, int w, int h, int channels)
+void connection_reset_request(http_connection *connection)
 {
-    int half_window = MEDIAN_WINDOW / 2;
-
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            for (int c = 0; c < channels; c++) {
-                float window[MEDIAN_WINDOW * MEDIAN_WINDOW];
-                int window_idx = 0;
+    connection->state = CONNECTION_RECEIVING_HEADERS;
+    connection->request_consumed = 0;
+    connection->method = "";
+    connection->path = "";
+    connection->query = "";
+    connection->window = MEDIAN_WINDOW;
+    connection->compression = COMPRESSION_BALANCED;
+    connection->body = NULL;
+    connection->body_size = 0;
+    connection->content_length = 0;
+    connection->ingest = NULL;
+    connection->keep_alive = true;
 
-                for (int wy = -half_window; wy <= half_window; wy++) {
-                    for (int wx = -half_window; wx <= half_window; wx++) {
-                        int sx = x + wx;
-                        int sy = y + wy;
+    http_request *request = &connection->request;
+    request->status = HTTP_PARSE_INCOMPLETE;
+    request->scanned = 0;
+    request->line_start = 0;
+    request->method = (http_slice){ 0, 0 };
+    request->path = (http_slice){ 0, 0 };
+    request->query = (http_slice){ 0, 0 };
+    request->minor_version = 0;
+    request->header_count = 0;
+    request->header_size = 0;
 
-                        int clamped_sx = sx < 0 ? 0 : (sx >= w ? w - 1 : sx);
-                        int clamped_sy = sy < 0 ? 0 : (sy >= h ? h - 1 : sy);
+    http_response *response = &connection->response;
+    response->header_data = NULL;
+    response->header_size = 0;
+    response->header_sent = 0;
+    response->body = NULL;
+    response->body_size = 0;
+    response->body_sent = 0;
+    response->cached_file = NULL;
+    response->result = NULL;
+    response->file_handle = -1;
+    response->file_offset = 0;
+    response->file_remaining = 0;
+}
 
-                        window[window_idx++] = (float)img[(clamped_sy * w + clamped_sx) * channels + c];
-                    }
-                }
+void connection_release(http_connection *connection)
+{
+    static_file_release(connection->response.cached_file);
+    connection->response.cached_file = NULL;
+    image_result_release(connection->response.result);
+    connection->response.result = NULL;
 
-                qsort(window, MEDIAN_WINDOW * MEDIAN_WINDOW, sizeof(float), float_compare);
-                filtered[(y * w + x) * channels + c] = (unsigned char)window[(MEDIAN_WINDOW * MEDIAN_WINDOW) / 2];
-            }
-        }
+    if (connection->response.file_handle != -1) {
+        close(connection->response.file_handle);
+        connection->response.file_handle = -1;
     }
+
+    slab_free(connection->body);
+    connection->body = NULL;
+
+    png_stream_destroy(connection->ingest);
+    connection->ingest = NULL;
 }
 
-void process_image(image_job_entry *job_table, const char *uuid_str)
+void connection_next_request(http_connection *connection)
 {
-    int idx = shgeti(job_table, uuid_str);
-    if (idx == -1) {
-        return;
-    }
+    connection_release(connection);
 
-    image_job *job = &job_table[idx].value;
+    size_t leftover = connection->request_size - connection->request_consumed;
+    memmove(connection->request_data, connection->request_data + connection->request_consumed, leftover);
+    connection->request_size = leftover;
+    connection->request_data[leftover] = '\0';
+    connection->requests_served++;
 
-    if (!job->original_image || job->original_size == 0) {
-        return;
-    }
+    connection_reset_request(connection);
+}
 
-    int w, h, channels;
-    unsigned char *img = stbi_load_from_memory(job->original_image, job->original_size, &w, &h, &channels, 0);
-    if (!img) {
-        return;
+io_status connection_process(http_connection *connection, server_context *context)
+{
+    while (true) {
+        io_status status;
+        switch (connection->state) {
+            case CONNECTION_RECEIVING_HEADERS:
+                status = receive_request(connection);
+                if (status != IO_DONE) {
+                    return status;
+                }
+                if (dispatch_request(connection, context) != 0) {
+                    return IO_ERROR;
+                }
+                if (connection->state == CONNECTION_SENDING_RESPONSE && finish_response_header(connection) != 0) {
+                    return IO_ERROR;
+                }
+                break;
+            case CONNECTION_RECEIVING_BODY:
+                status = receive_body(connection);
+                if (status != IO_DONE) {
+                    return status;
+                }
+                if (complete_post_images(connection, context) != 0) {
+                    return IO_ERROR;
+                }
+                if (finish_response_header(connection) != 0) {
+                    return IO_ERROR;
+                }
+                break;
+            case CONNECTION_SENDING_RESPONSE:
+                status = send_response(connection);
+                if (status != IO_DONE) {
+                    if (status == IO_ERROR) {
+                        perror("Failed to send the response");
+                    }
+                    return status;
+                }
+                if (connection->keep_alive) {
+                    // Report each finished response so that the driver can
+                    // apply its idle timeout before the next request arrives.
+                    connection_next_request(connection);
+                    return IO_DONE;
+                }
+                connection->state = CONNECTION_FINISHED;
+                break;
+            case CONNECTION_FINISHED:
+            case CONNECTION_DRAINING:
+                return IO_DONE;
+        }
     }
+}
 
-    size_t alloc_size = (size_t)w * (size_t)h * (size_t)channels;
-    if (alloc_size > SIZE_MAX / sizeof(unsigned char) || w <= 0 || h <= 0 || channels <= 0) {
-        stbi_image_free(img);
+void handle_connection(server_context *context, int request_socket)
+{
+    http_connection *connection = malloc(sizeof(*connection));
+    if (!connection) {
+        perror("Failed to allocate the connection state");
+        cleanup_connection(request_socket);
         return;
     }
+    connection_init(connection, request_socket);
 
-    unsigned char *filtered = calloc(w * h * channels, sizeof(unsigned char));
-    if (!filtered) {
-        stbi_image_free(img);
-        return;
+    while (true) {
+        io_status status = connection_process(connection, context);
+        if (status == IO_WANT_READ && connection->state == CONNECTION_RECEIVING_BODY) {
+            fprintf(stderr, "Timeout while receiving image data\n");
+        } else if (status == IO_WANT_READ || status == IO_WANT_WRITE) {
+            fprintf(stderr, "Timeout while serving the connection\n");
+        }
+        if (status != IO_DONE || connection->state != CONNECTION_RECEIVING_HEADERS) {
+            break;
+        }
+
+        // An idle persistent connection pins this worker, so it is given up
+        // early when other connections are already waiting for one.
+        if (connection->request_size == 0) {
+            if (connection_queue_waiting(&context->queue)) {
+                break;
+            }
+            struct pollfd readable = { .fd = request_socket, .events = POLLIN };
+            int ready;
+            do {
+                ready = poll(&readable, 1, KEEP_ALIVE_TIMEOUT_SECONDS * 1000);
+            } while (ready == -1 && errno == EINTR);
+            if (ready <= 0) {
+                break;
+            }
+        }
     }
 
-    apply_median_filter(img, filtered, w, h, channels);
+    connection_release(connection);
+    free(connection);
 
-    unsigned char *out_buffer = NULL;
-    size_t out_size = 0;
+    cleanup_connection(request_socket);
+}
 
-    buffer_context ctx = { &out_buffer, &out_size };
-    stbi_write_png_to_func(write_image_callback, &ctx, w, h, channels, filtered, w * channels);
+void *connection_worker(void *argument)
+{
+    server_context *context = (server_context *)argument;
 
-    free(filtered);
-    stbi_image_free(img);
-    if (job->processed_image) {
-        free(job->processed_image);
-        job->processed_image = NULL;
-        job->processed_size = 0;
+    int request_socket;
+    while ((request_socket = connection_queue_pop(&context->queue)) != -1) {
+        handle_connection(context, request_socket);
     }
 
-    if (out_buffer) {
-        job->processed_image = out_buffer;
-        job->processed_size = out_size;
-    }
+    return NULL;
 }
 
-int handle_post_images(int request_socket, const char *request_data, ssize_t bytes_received, image_job_entry **job_table)
+int image_task_queue_init(image_task_queue *queue, size_t memory_limit)
 {
-    char *content_length_start = strstr(request_data, "Content-Length: ");
-    if (!content_length_start) {
-        char response_data[] = "HTTP/1.1 411 Length Required\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 411 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
-    }
-    char *endptr;
-    errno = 0;
-    size_t content_length = strtoul(content_length_start + 16, &endptr, 10);
-    if (errno != 0 || *endptr != '\r' || content_length == 0) {
-        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 400 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
-    }
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->length = 0;
+    queue->memory_limit = memory_limit;
+    queue->memory_reserved = 0;
+    queue->refused = 0;
+    queue->running = 0;
+    queue->closed = false;
 
-    if (content_length > MAX_IMAGE_SIZE) {
-        char response_data[] = "HTTP/1.1 413 Payload Too Large\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 413 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
+    if (pthread_mutex_init(&queue->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the image task queue lock\n");
+        return EXIT_FAILURE;
     }
-
-    char *body_start = strstr(request_data, "\r\n\r\n");
-    if (!body_start) {
-        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 400 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
+    if (pthread_cond_init(&queue->not_empty, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize the image task queue condition\n");
+        pthread_mutex_destroy(&queue->lock);
+        return EXIT_FAILURE;
     }
 
-    body_start += 4;
-    size_t header_size = body_start - request_data;
+    return EXIT_SUCCESS;
+}
 
-    if (header_size > (size_t)bytes_received) {
-        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 400 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
+void image_task_queue_destroy(image_task_queue *queue)
+{
+    while (queue->head != NULL) {
+        image_task *task = queue->head;
+        queue->head = task->next;
+        free(task);
     }
+    queue->tail = NULL;
 
-    size_t initial_body_size = bytes_received - header_size;
-
-    unsigned char *image_buffer = NULL;
-    image_buffer = calloc(1, content_length);
-    if (!image_buffer) {
-        char response_data[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 500 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
-    }
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+}
 
-    if (initial_body_size > content_length) {
-        initial_body_size = content_length;
+bool image_task_queue_accepting(image_task_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool accepting = queue->length < IMAGE_TASK_QUEUE_SIZE;
+    if (!accepting) {
+        queue->refused++;
     }
+    pthread_mutex_unlock(&queue->lock);
 
-    memcpy(image_buffer, body_start, initial_body_size);
-    size_t total_image_size = initial_body_size;
+    return accepting;
+}
 
-    while (total_image_size < content_length) {
-        size_t remaining = content_length - total_image_size;
-        ssize_t bytes_received = recv(request_socket, image_buffer + total_image_size, remaining, 0);
-        if (bytes_received < 0) {
-            if (errno == EINTR) {
-                continue;
-            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                perror("Timeout while receiving image data");
-                free(image_buffer);
-                return 0;
-            } else {
-                perror("Error receiving image data");
-                free(image_buffer);
-                return 0;
-            }
-        } else if (bytes_received == 0) {
-            fprintf(stderr, "Client disconnected during image upload\n");
-            free(image_buffer);
-            return 0;
-        }
-        total_image_size += bytes_received;
+bool image_task_queue_reserve(image_task_queue *queue, size_t upload)
+{
+    // Takes a place in the queue for an upload about to be pushed, and
+    // counts its bytes against the budget while it waits.
+    pthread_mutex_lock(&queue->lock);
+    bool reserved = queue->length < IMAGE_TASK_QUEUE_SIZE && queue->memory_reserved + upload <= queue->memory_limit;
+    if (reserved) {
+        queue->length++;
+        queue->memory_reserved += upload;
+    } else {
+        queue->refused++;
     }
+    pthread_mutex_unlock(&queue->lock);
 
-    uuid_t uuid;
-    uuid_generate(uuid);
+    return reserved;
+}
 
-    char uuid_str[37];
-    uuid_unparse_lower(uuid, uuid_str);
+void image_task_queue_cancel(image_task_queue *queue, size_t upload)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->length--;
+    queue->memory_reserved -= upload;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    image_job new_job = {
-        .original_image = image_buffer,
-        .original_size = total_image_size,
-        .processed_image = NULL,
-        .processed_size = 0
-    };
+void image_task_queue_push(image_task_queue *queue, image_task *task)
+{
+    task->next = NULL;
 
-    char *key_copy = strdup(uuid_str);
-    if (!key_copy) {
-        free(image_buffer);
-        char response_data[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 500 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail != NULL) {
+        queue->tail->next = task;
+    } else {
+        queue->head = task;
     }
+    queue->tail = task;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    shput(*job_table, key_copy, new_job);
+image_task *image_task_queue_pop(image_task_queue *queue)
+{
+    // A task starts only once the memory it needs beyond its upload, which
+    // is already counted, is free. Tasks start in order, so a large one is
+    // not starved by smaller ones behind it. With nothing running a task
+    // always starts, since waiting uploads alone could otherwise hold the
+    // whole budget.
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->closed && (queue->head == NULL ||
+           (queue->running > 0 && queue->memory_reserved + (queue->head->memory - queue->head->upload) > queue->memory_limit))) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
 
-    char response_header[256];
-    int written = snprintf(response_header, sizeof(response_header), "HTTP/1.1 202 Accepted\r\nLocation: /images/%s/\r\n\r\n", uuid_str);
-    if (written < 0 || written >= sizeof(response_header)) {
-        char response_data[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 500 response");
-            return EXIT_FAILURE;
+    image_task *task = queue->head;
+    if (task != NULL) {
+        queue->head = task->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        queue->length--;
+        queue->memory_reserved += task->memory - task->upload;
+        queue->running++;
+        if (queue->head != NULL) {
+            pthread_cond_signal(&queue->not_empty);
         }
-        return 0;
     }
+    pthread_mutex_unlock(&queue->lock);
 
-    if (send_all(request_socket, response_header, written, 0) == -1) {
-        perror("Failed to send the 202 response");
-        return EXIT_FAILURE;
-    }
+    return task;
+}
 
-    process_image(*job_table, uuid_str);
+void image_task_queue_release(image_task_queue *queue, size_t memory)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->memory_reserved -= memory;
+    queue->running--;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    return 0;
+void image_task_queue_close(image_task_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
 }
 
-int handle_get_image(int request_socket, const char *path, image_job_entry *job_table)
+void *image_worker(void *argument)
 {
-    char uuid_str[37] = {0};
-    if (sscanf(path, "/images/%36[0-9a-f-]", uuid_str) != 1 || 
-        strlen(uuid_str) != 36) {
-        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 400 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
-    }
+    server_context *context = (server_context *)argument;
 
-    if (uuid_str[8] != '-' || uuid_str[13] != '-' || uuid_str[18] != '-' || uuid_str[23] != '-') {
-        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 400 response");
-            return EXIT_FAILURE;
+    image_task *task;
+    while ((task = image_task_queue_pop(&context->tasks)) != NULL) {
+        // A retried duplicate has the same upload, so the task's memory
+        // reservation covers it too.
+        for (image_job *job = task->job; job != NULL; job = image_job_finish(context, job)) {
+            process_image(job, &context->bands);
         }
-        return 0;
+        image_task_queue_release(&context->tasks, task->memory);
+        free(task);
     }
 
-    int idx = shgeti(job_table, uuid_str);
-    if (idx == -1) {
-        char response_data[] = "HTTP/1.1 404 Not Found\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 404 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
+    return NULL;
+}
+
+time_t monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+void connection_list_append(connection_list *list, http_connection *connection)
+{
+    connection->prev = list->tail;
+    connection->next = NULL;
+    if (list->tail != NULL) {
+        list->tail->next = connection;
+    } else {
+        list->head = connection;
     }
+    list->tail = connection;
+}
 
-    image_job job = shget(job_table, uuid_str);
-    if (!job.processed_image) {
-        char response_data[] = "HTTP/1.1 202 Accepted\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 202 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
+void connection_list_remove(connection_list *list, http_connection *connection)
+{
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        list->head = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    } else {
+        list->tail = connection->prev;
     }
+    connection->prev = NULL;
+    connection->next = NULL;
+}
 
-    char response_header[] = "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n\r\n";
-    if (send_all(request_socket, response_header, sizeof(response_header) - 1, 0) == -1) {
-        perror("Failed to send the 200 response header");
+int event_loop_init(event_loop *loop, server_context *context, int server_socket)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->context = context;
+    loop->server_socket = server_socket;
+
+    loop->epoll_handle = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_handle == -1) {
+        perror("Failed to create an epoll instance");
         return EXIT_FAILURE;
     }
 
-    if (send_all(request_socket, job.processed_image, job.processed_size, 0) == -1) {
-        perror("Failed to send the processed image");
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_handle, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+        perror("Failed to watch the server socket");
+        close(loop->epoll_handle);
+        loop->epoll_handle = -1;
         return EXIT_FAILURE;
     }
 
-    return 0;
+    return EXIT_SUCCESS;
 }
 
-int handle_get_static_file(int request_socket, const char *path, const char *server_dir_path, size_t server_dir_path_len, int *file_to_serve_handle)
+void event_loop_accept(event_loop *loop)
 {
-    if (strstr(path, "..") != NULL) {
-        char response_data[] = "HTTP/1.1 403 Forbidden\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 403 response");
-            return EXIT_FAILURE;
+    while (true) {
+        int request_socket = accept4(loop->server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (request_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Failed to accept a new connection");
+            }
+            return;
         }
-        return 0;
-    }
 
-    if (path[0] != '/') {
-        char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 400 response");
-            return EXIT_FAILURE;
+        if (set_client_socket_options(request_socket) != EXIT_SUCCESS) {
+            close(request_socket);
+            continue;
         }
-        return 0;
-    }
 
-    char file_name[NAME_MAX + 1] = {0};
-    size_t path_len = strlen(path);
+        http_connection *connection = malloc(sizeof(*connection));
+        if (!connection) {
+            perror("Failed to allocate the connection state");
+            close(request_socket);
+            continue;
+        }
+        connection_init(connection, request_socket);
 
-    if (path_len > NAME_MAX) {
-        char response_data[] = "HTTP/1.1 414 URI Too Long\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 414 response");
-            return EXIT_FAILURE;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(loop->epoll_handle, EPOLL_CTL_ADD, request_socket, &event) == -1) {
+            perror("Failed to watch a client socket");
+            close(request_socket);
+            free(connection);
+            continue;
         }
-        return 0;
-    }
 
-    strncpy(file_name, path, NAME_MAX);
-    file_name[NAME_MAX] = '\0';
+        connection->last_activity = monotonic_seconds();
+        connection_list_append(&loop->active_connections, connection);
 
-    if (strcmp(file_name, "/") == 0) {
-        strncat(file_name, "index.html", NAME_MAX - strlen(file_name));
+        event_loop_handle(loop, connection);
     }
+}
 
-    const char* file_path_part = file_name;
-    if (file_path_part[0] == '/') {
-        file_path_part++;
+void event_loop_close_connection(event_loop *loop, http_connection *connection)
+{
+    if (connection->state == CONNECTION_DRAINING) {
+        connection_list_remove(&loop->draining_connections, connection);
+    } else if (connection->idle) {
+        connection_list_remove(&loop->idle_connections, connection);
+    } else {
+        connection_list_remove(&loop->active_connections, connection);
     }
 
-    char file_path[PATH_MAX + 1] = {0};
-    int path_len_required = snprintf(file_path, PATH_MAX, "%s/%s", server_dir_path, file_path_part);
-
-    if (path_len_required < 0 || path_len_required >= PATH_MAX) {
-        char response_data[] = "HTTP/1.1 414 URI Too Long\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 414 response");
-            return EXIT_FAILURE;
-        }
-        return 0;
+    connection_release(connection);
+    if (close(connection->socket) == -1) {
+        perror("Warning: Failed to close the socket");
     }
+    free(connection);
+}
 
-    char resolved_path[PATH_MAX + 1] = {0};
-    if (realpath(file_path, resolved_path) == NULL) {
-        char response_data[] = "HTTP/1.1 404 Not Found\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 404 response");
-            return EXIT_FAILURE;
+void event_loop_drain(event_loop *loop, http_connection *connection)
+{
+    char leftovers[1024];
+    while (true) {
+        ssize_t bytes_read = recv(connection->socket, leftovers, sizeof(leftovers), 0);
+        if (bytes_read > 0) {
+            continue;
         }
-        return 0;
-    }
-    if (strncmp(resolved_path, server_dir_path, server_dir_path_len) != 0) {
-        char response_data[] = "HTTP/1.1 403 Forbidden\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 403 response");
-            return EXIT_FAILURE;
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
         }
-        return 0;
-    }
-
-    *file_to_serve_handle = open(resolved_path, O_RDONLY);
-    if (*file_to_serve_handle == -1) {
-        char response_data[] = "HTTP/1.1 404 Not Found\r\n\r\n";
-        if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-            perror("Failed to send the 404 response");
-            return EXIT_FAILURE;
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
         }
-        return 0;
+        event_loop_close_connection(loop, connection);
+        return;
     }
+}
 
-    char response_data[] = "HTTP/1.1 200 OK\r\n\r\n";
-    if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-        perror("Failed to send the response header");
-        return EXIT_FAILURE;
+void event_loop_handle(event_loop *loop, http_connection *connection)
+{
+    if (connection->state == CONNECTION_DRAINING) {
+        event_loop_drain(loop, connection);
+        return;
     }
 
-    char file_data[MAX_REQUEST_SIZE];
-    ssize_t bytes_read;
-    while ((bytes_read = read(*file_to_serve_handle, file_data, MAX_REQUEST_SIZE)) > 0) {
-        if (send_all(request_socket, file_data, bytes_read, 0) == -1) {
-            perror("Failed to send the requested file");
-            return EXIT_FAILURE;
-        }
+    connection_list_remove(connection->idle ? &loop->idle_connections : &loop->active_connections, connection);
+    connection->idle = false;
+    connection->last_activity = monotonic_seconds();
+    connection_list_append(&loop->active_connections, connection);
+
+    io_status status;
+    while ((status = connection_process(connection, loop->context)) == IO_DONE &&
+           connection->state == CONNECTION_RECEIVING_HEADERS) {}
+
+    if (status == IO_WANT_READ && connection->state == CONNECTION_RECEIVING_HEADERS &&
+        connection->request_size == 0 && connection->requests_served > 0) {
+        // Between requests the connection waits on the shorter keep-alive timeout.
+        connection_list_remove(&loop->active_connections, connection);
+        connection->idle = true;
+        connection_list_append(&loop->idle_connections, connection);
+        return;
+    }
+    if (status == IO_WANT_READ || status == IO_WANT_WRITE) {
+        return;
+    }
+    if (status != IO_DONE) {
+        event_loop_close_connection(loop, connection);
+        return;
     }
 
-    if (bytes_read == -1) {
-        perror("Failed to read the requested file");
-        return EXIT_FAILURE;
+    connection_release(connection);
+
+    if (shutdown(connection->socket, SHUT_WR) == -1) {
+        if (errno != ENOTCONN) {
+            perror("Warning: Failed to shutdown write side of socket");
+        }
+        event_loop_close_connection(loop, connection);
+        return;
     }
 
-    close(*file_to_serve_handle);
-    *file_to_serve_handle = -1;
+    connection_list_remove(&loop->active_connections, connection);
+    connection->state = CONNECTION_DRAINING;
+    connection->last_activity = monotonic_seconds();
+    connection_list_append(&loop->draining_connections, connection);
 
-    return 0;
+    event_loop_drain(loop, connection);
 }
 
-int send_not_implemented(int request_socket)
+void event_loop_expire(event_loop *loop)
 {
-    char response_data[] = "HTTP/1.1 501 Not Implemented\r\n\r\n";
-    if (send_all(request_socket, response_data, sizeof(response_data) - 1, 0) == -1) {
-        perror("Failed to send the 501 response");
-        return EXIT_FAILURE;
-    }
-    return 0;
-}
+    time_t now = monotonic_seconds();
 
-int set_client_socket_options(int client_socket)
-{
-    if (client_socket < 0) {
-        return EXIT_FAILURE;
+    while (loop->active_connections.head != NULL &&
+           now - loop->active_connections.head->last_activity >= CLIENT_TIMEOUT_SECONDS) {
+        event_loop_close_connection(loop, loop->active_connections.head);
     }
 
-    const int tcp_nodelay = 1;
-    if (setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &tcp_nodelay, sizeof(tcp_nodelay)) == -1) {
-        perror("Failed to set TCP_NODELAY");
-        return EXIT_FAILURE;
+    while (loop->idle_connections.head != NULL &&
+           now - loop->idle_connections.head->last_activity >= KEEP_ALIVE_TIMEOUT_SECONDS) {
+        event_loop_close_connection(loop, loop->idle_connections.head);
     }
 
-    struct timeval timeout;
-    timeout.tv_sec = 15;
-    timeout.tv_usec = 0;
-    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
-        perror("Failed to set client receive timeout");
-        return EXIT_FAILURE;
+    while (loop->draining_connections.head != NULL &&
+           now - loop->draining_connections.head->last_activity >= DRAIN_TIMEOUT_SECONDS) {
+        event_loop_close_connection(loop, loop->draining_connections.head);
     }
+}
 
-    if (setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == -1) {
-        perror("Failed to set client send timeout");
-        return EXIT_FAILURE;
+void *event_loop_worker(void *argument)
+{
+    event_loop *loop = (event_loop *)argument;
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (true) {
+        int event_count = epoll_wait(loop->epoll_handle, events, MAX_EPOLL_EVENTS, 1000);
+        if (event_count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for socket events");
+            break;
+        }
+
+        for (int i = 0; i < event_count; i++) {
+            http_connection *connection = (http_connection *)events[i].data.ptr;
+            if (connection == NULL) {
+                event_loop_accept(loop);
+            } else {
+                event_loop_handle(loop, connection);
+            }
+        }
+
+        event_loop_expire(loop);
     }
 
-    return EXIT_SUCCESS;
+    return NULL;
 }
 
 int main(int argc, char *argv[])
@@ -739,18 +7204,165 @@ int main(int argc, char *argv[])
 
     int server_socket  = -1;
     int request_socket = -1;
-    int file_to_serve_handle = -1;
 
-    image_job_entry *job_table = NULL;
+    server_mode mode = SERVER_MODE_BLOCKING;
+    long worker_count = DEFAULT_WORKER_THREADS;
+    pthread_t *workers = NULL;
+    event_loop *loops = NULL;
+    long started_workers = 0;
+    bool queue_ready = false;
+
+    long filter_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (filter_count < 1) {
+        filter_count = 1;
+    }
+    pthread_t *filters = NULL;
+    long started_filters = 0;
+    bool tasks_ready = false;
+
+    long band_count = filter_count;
+    long memory_limit_mb = DEFAULT_MEMORY_LIMIT_MB;
+    long result_limit_mb = DEFAULT_RESULT_LIMIT_MB;
+    long result_ttl = DEFAULT_RESULT_TTL_SECONDS;
+    bool retention_ready = false;
+    bool bands_ready = false;
+    bool statics_ready = false;
+
+    static server_context context;
+    context.streaming_ingest = true;
+    if (job_store_init(&context.jobs) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (result_cache_init(&context.results) != EXIT_SUCCESS) {
+        job_store_destroy(&context.jobs);
+        return EXIT_FAILURE;
+    }
+
+    int option;
+    while ((option = getopt(argc, argv, "b:e:f:l:m:p:r:t:u:")) != -1) {
+        switch (option) {
+            case 'b': {
+                char *endptr;
+                errno = 0;
+                band_count = strtol(optarg, &endptr, 10);
+                if (errno != 0 || *endptr != '\0' || band_count < 0 || band_count > MAX_BAND_THREADS) {
+                    fprintf(stderr, "The number of band threads must be between 0 and %d\n", MAX_BAND_THREADS);
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            }
+            case 'f': {
+                char *endptr;
+                errno = 0;
+                filter_count = strtol(optarg, &endptr, 10);
+                if (errno != 0 || *endptr != '\0' || filter_count < 1 || filter_count > MAX_FILTER_THREADS) {
+                    fprintf(stderr, "The number of filter threads must be between 1 and %d\n", MAX_FILTER_THREADS);
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            }
+            case 'e': {
+                char *endptr;
+                errno = 0;
+                result_ttl = strtol(optarg, &endptr, 10);
+                if (errno != 0 || *endptr != '\0' || result_ttl < 1 || result_ttl > MAX_RESULT_TTL_SECONDS) {
+                    fprintf(stderr, "The result lifetime must be between 1 and %d seconds\n", MAX_RESULT_TTL_SECONDS);
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            }
+            case 'l': {
+                char *endptr;
+                errno = 0;
+                memory_limit_mb = strtol(optarg, &endptr, 10);
+                if (errno != 0 || *endptr != '\0' || memory_limit_mb < 1 || memory_limit_mb > MAX_MEMORY_LIMIT_MB) {
+                    fprintf(stderr, "The image memory limit must be between 1 and %d megabytes\n", MAX_MEMORY_LIMIT_MB);
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            }
+            case 'm':
+                if (strcmp(optarg, "blocking") == 0) {
+                    mode = SERVER_MODE_BLOCKING;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    mode = SERVER_MODE_EPOLL;
+                } else {
+                    fprintf(stderr, "The server mode must be either blocking or epoll\n");
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "huge") == 0) {
+                    slab_huge_pages = true;
+                } else if (strcmp(optarg, "normal") == 0) {
+                    slab_huge_pages = false;
+                } else {
+                    fprintf(stderr, "The page mode must be either huge or normal\n");
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            case 'u':
+                if (strcmp(optarg, "streaming") == 0) {
+                    context.streaming_ingest = true;
+                } else if (strcmp(optarg, "buffered") == 0) {
+                    context.streaming_ingest = false;
+                } else {
+                    fprintf(stderr, "The upload mode must be either streaming or buffered\n");
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            case 'r': {
+                char *endptr;
+                errno = 0;
+                result_limit_mb = strtol(optarg, &endptr, 10);
+                if (errno != 0 || *endptr != '\0' || result_limit_mb < 1 || result_limit_mb > MAX_MEMORY_LIMIT_MB) {
+                    fprintf(stderr, "The result memory limit must be between 1 and %d megabytes\n", MAX_MEMORY_LIMIT_MB);
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            }
+            case 't': {
+                char *endptr;
+                errno = 0;
+                worker_count = strtol(optarg, &endptr, 10);
+                if (errno != 0 || *endptr != '\0' || worker_count < 1 || worker_count > MAX_WORKER_THREADS) {
+                    fprintf(stderr, "The number of worker threads must be between 1 and %d\n", MAX_WORKER_THREADS);
+                    program_status = EXIT_FAILURE;
+                    goto end;
+                }
+                break;
+            }
+            default:
+                fprintf(stderr, "Usage: %s [-m blocking|epoll] [-t worker_threads] [-f filter_threads] [-b band_threads] [-l memory_limit_mb] [-r result_limit_mb] [-e result_ttl_seconds] [-p huge|normal] [-u streaming|buffered]\n", argv[0]);
+                program_status = EXIT_FAILURE;
+                goto end;
+        }
+    }
+
+    slab_pages_init();
 
-    char server_dir_path[PATH_MAX + 1] = {0};
-    if (realpath(SERVER_DIR, server_dir_path) == NULL) {
+    if (realpath(SERVER_DIR, context.server_dir_path) == NULL) {
         perror("Failed to resolve the " SERVER_DIR " into an absolute path");
         program_status = EXIT_FAILURE;
         goto end;
     }
-    server_dir_path[PATH_MAX]  = '\0';
-    size_t server_dir_path_len = strlen(server_dir_path);
+    context.server_dir_path[PATH_MAX] = '\0';
+    context.server_dir_path_len = strlen(context.server_dir_path);
+
+    if (static_cache_init(&context.statics, context.server_dir_path) != EXIT_SUCCESS) {
+        program_status = EXIT_FAILURE;
+        goto end;
+    }
+    statics_ready = true;
+    printf("Cached %zu static files (%zu bytes) from " SERVER_DIR "\n", context.statics.count, context.statics.cached_bytes);
 
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -766,6 +7378,102 @@ int main(int argc, char *argv[])
         goto end;
     }
 
+    if (band_pool_init(&context.bands, band_count) != EXIT_SUCCESS) {
+        program_status = EXIT_FAILURE;
+        goto end;
+    }
+    bands_ready = true;
+    printf("Filtering large images in bands on %ld threads\n", band_count);
+
+    if (image_task_queue_init(&context.tasks, (size_t)memory_limit_mb * 1024 * 1024) != EXIT_SUCCESS) {
+        program_status = EXIT_FAILURE;
+        goto end;
+    }
+    tasks_ready = true;
+
+    if (job_retention_init(&context.retention, &context.jobs, &context.results, (size_t)result_limit_mb * 1024 * 1024, result_ttl) != EXIT_SUCCESS) {
+        program_status = EXIT_FAILURE;
+        goto end;
+    }
+    retention_ready = true;
+    printf("Keeping results for %ld seconds within %ld MB\n", result_ttl, result_limit_mb);
+
+    filters = calloc(filter_count, sizeof(pthread_t));
+    if (!filters) {
+        perror("Failed to allocate the filter threads");
+        program_status = EXIT_FAILURE;
+        goto end;
+    }
+    for (; started_filters < filter_count; started_filters++) {
+        int error = pthread_create(&filters[started_filters], NULL, image_worker, &context);
+        if (error != 0) {
+            fprintf(stderr, "Failed to start a filter thread: %s\n", strerror(error));
+            program_status = EXIT_FAILURE;
+            goto end;
+        }
+    }
+    printf("Processing images with %ld filter threads within %ld MB\n", filter_count, memory_limit_mb);
+
+    workers = calloc(worker_count, sizeof(pthread_t));
+    if (!workers) {
+        perror("Failed to allocate the worker threads");
+        program_status = EXIT_FAILURE;
+        goto end;
+    }
+
+    if (mode == SERVER_MODE_EPOLL) {
+        int flags = fcntl(server_socket, F_GETFL, 0);
+        if (flags == -1 || fcntl(server_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("Failed to make the server socket non-blocking");
+            program_status = EXIT_FAILURE;
+            goto end;
+        }
+
+        loops = calloc(worker_count, sizeof(event_loop));
+        if (!loops) {
+            perror("Failed to allocate the event loops");
+            program_status = EXIT_FAILURE;
+            goto end;
+        }
+        for (; started_workers < worker_count; started_workers++) {
+            if (event_loop_init(&loops[started_workers], &context, server_socket) != EXIT_SUCCESS) {
+                program_status = EXIT_FAILURE;
+                goto end;
+            }
+            int error = pthread_create(&workers[started_workers], NULL, event_loop_worker, &loops[started_workers]);
+            if (error != 0) {
+                fprintf(stderr, "Failed to start an event loop thread: %s\n", strerror(error));
+                close(loops[started_workers].epoll_handle);
+                program_status = EXIT_FAILURE;
+                goto end;
+            }
+        }
+        printf("Serving connections with %ld epoll event loops\n", worker_count);
+
+        for (long i = 0; i < started_workers; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        started_workers = 0;
+        program_status = EXIT_FAILURE;
+        goto end;
+    }
+
+    if (connection_queue_init(&context.queue, CONNECTION_QUEUE_SIZE) != EXIT_SUCCESS) {
+        program_status = EXIT_FAILURE;
+        goto end;
+    }
+    queue_ready = true;
+
+    for (; started_workers < worker_count; started_workers++) {
+        int error = pthread_create(&workers[started_workers], NULL, connection_worker, &context);
+        if (error != 0) {
+            fprintf(stderr, "Failed to start a worker thread: %s\n", strerror(error));
+            program_status = EXIT_FAILURE;
+            goto end;
+        }
+    }
+    printf("Serving connections with %ld worker threads\n", worker_count);
+
     while (true) {
         struct sockaddr_in client_address;
         socklen_t client_address_size = sizeof(client_address);
@@ -786,51 +7494,55 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        char request_data[MAX_REQUEST_SIZE + 1] = {0};
-        ssize_t bytes_received = receive_request(request_socket, request_data, MAX_REQUEST_SIZE);
-        if (bytes_received == -1) {
-            cleanup_connection(request_socket);
-            request_socket = -1;
-            continue;
-        } 
-        if (bytes_received == 0) {
-            cleanup_connection(request_socket);
-            request_socket = -1;
-            continue;
-        }
-
-        char method[10] = {0};
-        char path[PATH_MAX + 1] = {0};
-        parse_request(request_data, method, path);
-        if (method[0] == '\0' || path[0] == '\0') {
-            char response_data[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
-            send_all(request_socket, response_data, sizeof(response_data) - 1, 0);
-            cleanup_connection(request_socket);
-            request_socket = -1;
-            continue;
-        }
-
-        int result = EXIT_SUCCESS;
-        if (strcmp(method, "POST") == 0 && strcmp(path, "/images") == 0) {
-            result = handle_post_images(request_socket, request_data, bytes_received, &job_table);
-        } else if (strcmp(method, "GET") == 0 && strncmp(path, "/images/", 8) == 0) {
-            result = handle_get_image(request_socket, path, job_table);
-        } else if (strcmp(method, "GET") == 0) {
-            result = handle_get_static_file(request_socket, path, server_dir_path, server_dir_path_len, &file_to_serve_handle);
-        } else {
-            result = send_not_implemented(request_socket);
-        }
-        if (result == EXIT_FAILURE) {
+        if (connection_queue_push(&context.queue, request_socket) != EXIT_SUCCESS) {
             program_status = EXIT_FAILURE;
             goto end;
         }
-
-        cleanup_connection(request_socket);
         request_socket = -1;
     }
 
 end:
-    cleanup_resources(file_to_serve_handle, request_socket, server_socket, job_table);
+    if (queue_ready) {
+        connection_queue_close(&context.queue);
+    }
+    if (mode == SERVER_MODE_EPOLL) {
+        for (long i = 0; i < started_workers; i++) {
+            pthread_cancel(workers[i]);
+        }
+    }
+    for (long i = 0; i < started_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(loops);
+    if (queue_ready) {
+        connection_queue_destroy(&context.queue);
+    }
+
+    if (tasks_ready) {
+        image_task_queue_close(&context.tasks);
+    }
+    for (long i = 0; i < started_filters; i++) {
+        pthread_join(filters[i], NULL);
+    }
+    free(filters);
+    if (tasks_ready) {
+        image_task_queue_destroy(&context.tasks);
+    }
+    if (retention_ready) {
+        job_retention_destroy(&context.retention);
+    }
+
+    if (bands_ready) {
+        band_pool_destroy(&context.bands);
+    }
+
+    if (statics_ready) {
+        static_cache_destroy(&context.statics);
+    }
+
+    result_cache_destroy(&context.results);
+    cleanup_resources(request_socket, server_socket, &context.jobs);
 
     return program_status;
-}
+}
\ No newline at end of file